@@ -2,7 +2,556 @@
 #include <fstream>
 #include <vector>
 #include <stdexcept>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
 #include <stdint.h>
+#include <cstdarg>
+#include <cstdlib>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#include "expected_table.h"
+#include "telemetry.h"
+
+extern "C" {
+// bounds of the oh_expected section (-oh-expected-storage=section), defined
+// by the linker when the program has the section
+extern const char __start_oh_expected[] __attribute__((weak));
+extern const char __stop_oh_expected[] __attribute__((weak));
+// path of the sidecar file (-oh-expected-storage=file)
+extern const char oh_expected_file[] __attribute__((weak));
+}
+
+namespace {
+
+// back-off state of sampled assertion sites (-oh-sample-backoff), kept per
+// thread so rearming never synchronizes
+struct sample_state
+{
+	unsigned interval;
+	unsigned passes;
+};
+
+std::mutex dumper_mutex;
+thread_local std::vector<sample_state> sample_states;
+
+// expected hashes registered by the module constructor of protected
+// programs (-oh-assert-mode=async); site i expects one of
+// expected_values[expected_offsets[i], expected_offsets[i + 1])
+const uint32_t* expected_offsets = nullptr;
+const uint64_t* expected_values = nullptr;
+unsigned expected_sites_count = 0;
+
+bool is_expected(unsigned id, uint64_t hash)
+{
+	if (id >= expected_sites_count) {
+		return false;
+	}
+	return std::binary_search(expected_values + expected_offsets[id],
+				  expected_values + expected_offsets[id + 1], hash);
+}
+
+// bounded single producer single consumer queue of (site id, hash) pairs.
+// Every application thread checking with -oh-assert-mode=async owns one,
+// the verifier drains them all. The producer and consumer positions live on
+// separate cache lines, each side caches the other's position.
+class verification_ring
+{
+public:
+	static const unsigned capacity = 1 << 12;
+
+	verification_ring()
+		: head(0)
+		, cached_tail(0)
+		, dropped(0)
+		, active(false)
+		, exited(false)
+		, tail(0)
+		, cached_head(0)
+		, stopped(false)
+		, next(nullptr)
+	{
+	}
+
+	// called on the owning thread. never blocks, drops the check when the
+	// verifier is a full ring behind
+	void push(unsigned id, uint64_t hash)
+	{
+		const size_t pos = head.load(std::memory_order_relaxed);
+		if (__builtin_expect(pos - cached_tail >= capacity, 0)) {
+			cached_tail = tail.load(std::memory_order_acquire);
+			if (pos - cached_tail >= capacity) {
+				dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				return;
+			}
+		}
+		cell& c = cells[pos & (capacity - 1)];
+		c.id = id;
+		c.hash = hash;
+		head.store(pos + 1, std::memory_order_release);
+	}
+
+	// called on the verifier thread, or by stop_verifier once it joined it
+	bool pop(unsigned& id, uint64_t& hash)
+	{
+		const size_t pos = tail.load(std::memory_order_relaxed);
+		if (pos == cached_head) {
+			cached_head = head.load(std::memory_order_acquire);
+			if (pos == cached_head) {
+				return false;
+			}
+		}
+		const cell& c = cells[pos & (capacity - 1)];
+		id = c.id;
+		hash = c.hash;
+		tail.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	uint64_t dropped_count() const
+	{
+		return dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct cell
+	{
+		unsigned id;
+		uint64_t hash;
+	};
+
+	// written by the owning thread
+	std::atomic<size_t> head;
+	size_t cached_tail;
+	std::atomic<uint64_t> dropped;
+	char producer_padding[64];
+
+public:
+	// set by the owner around a push, see oh_assert_async
+	std::atomic<bool> active;
+	// set by the owner when the thread exits, the verifier then drains and
+	// frees the ring
+	std::atomic<bool> exited;
+
+private:
+	// written by the verifier
+	std::atomic<size_t> tail;
+	size_t cached_head;
+	char consumer_padding[64];
+
+public:
+	// set once by stop_verifier, the owner then verifies its checks itself
+	std::atomic<bool> stopped;
+	// registered rings, pushed on the front of async_rings
+	verification_ring* next;
+
+private:
+	cell cells[capacity];
+};
+
+void unlink_telemetry_segment();
+
+// check counters (OH_TELEMETRY). Every thread counts into its own row of
+// the shared segment with plain increments, the threads beyond rows_count
+// share the last row and add atomically; checks count nothing without
+// OH_TELEMETRY, and into rows private to the thread when the segment can not
+// be created. The segment is unlinked at exit
+// unless OH_TELEMETRY_KEEP is set, readers attached before keep their
+// mapping.
+class telemetry
+{
+public:
+	telemetry()
+		: segment(nullptr)
+		, bits(31)
+		, groups_count(1)
+	{
+		const char* name = getenv("OH_TELEMETRY");
+		if (name == nullptr) {
+			return;
+		}
+		const char* groups_env = getenv("OH_TELEMETRY_GROUPS");
+		const char* bits_env = getenv("OH_TELEMETRY_GROUP_BITS");
+		const char* rows_env = getenv("OH_TELEMETRY_ROWS");
+		const uint32_t groups = groups_env ? strtoul(groups_env, nullptr, 10) : 256;
+		const uint32_t group_bits = bits_env ? strtoul(bits_env, nullptr, 10) : 6;
+		const uint32_t rows = rows_env ? strtoul(rows_env, nullptr, 10) : 64;
+		if (groups == 0 || rows == 0 || group_bits > 31) {
+			return;
+		}
+		// one segment per process, /<name>.<pid>
+		const std::string segment_name = std::string(name[0] == '/' ? "" : "/") + name + "." + std::to_string(getpid());
+		const uint64_t size = oh_telemetry::segment_size(rows, groups);
+		int fd = shm_open(segment_name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+		if (fd < 0) {
+			std::cerr << "oh: cannot create telemetry segment " << segment_name << "\n";
+			return;
+		}
+		void* memory = MAP_FAILED;
+		if (ftruncate(fd, size) == 0) {
+			memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+		if (memory == MAP_FAILED) {
+			shm_unlink(segment_name.c_str());
+			std::cerr << "oh: cannot map telemetry segment " << segment_name << "\n";
+			return;
+		}
+		segment = static_cast<oh_telemetry::header*>(memory);
+		const char* keep_env = getenv("OH_TELEMETRY_KEEP");
+		if (keep_env == nullptr || strtoul(keep_env, nullptr, 10) == 0) {
+			name_to_unlink = segment_name;
+			atexit(unlink_telemetry_segment);
+		}
+		segment->version = oh_telemetry::version;
+		segment->rows_count = rows;
+		segment->groups_count = groups;
+		segment->group_bits = group_bits;
+		segment->rows_used = 0;
+		segment->pid = getpid();
+		__atomic_store_n(&segment->magic, oh_telemetry::magic, __ATOMIC_RELEASE);
+		bits = group_bits;
+		groups_count = groups;
+	}
+
+	// shared is set for the last row once more threads than rows count
+	uint64_t* claim_row(bool& shared)
+	{
+		shared = false;
+		if (segment == nullptr) {
+			static thread_local uint64_t private_row[2];
+			return private_row;
+		}
+		const uint32_t index = __atomic_fetch_add(&segment->rows_used, 1, __ATOMIC_RELAXED);
+		shared = index + 1 >= segment->rows_count;
+		return oh_telemetry::row(segment, std::min(index, segment->rows_count - 1));
+	}
+
+	void unlink_segment()
+	{
+		if (!name_to_unlink.empty()) {
+			shm_unlink(name_to_unlink.c_str());
+			name_to_unlink.clear();
+		}
+	}
+
+	unsigned group_bits() const
+	{
+		return bits;
+	}
+
+	unsigned groups() const
+	{
+		return groups_count;
+	}
+
+private:
+	oh_telemetry::header* segment;
+	unsigned bits;
+	unsigned groups_count;
+	std::string name_to_unlink;
+};
+
+telemetry& get_telemetry()
+{
+	static telemetry instance;
+	return instance;
+}
+
+void unlink_telemetry_segment()
+{
+	get_telemetry().unlink_segment();
+}
+
+// whether OH_TELEMETRY is set, read once before the constructors of the
+// program so that checks without telemetry only test it
+bool telemetry_enabled = false;
+
+__attribute__((constructor(101))) void read_telemetry_enabled()
+{
+	telemetry_enabled = getenv("OH_TELEMETRY") != nullptr;
+}
+
+// the calling thread's row and the grouping, cached on the first check
+struct thread_telemetry
+{
+	uint64_t* row;
+	unsigned group_bits;
+	unsigned last_group;
+	unsigned failures_offset;
+	bool shared;
+};
+
+thread_local thread_telemetry current_telemetry = {nullptr, 0, 0, 0, false};
+
+inline thread_telemetry& get_thread_telemetry()
+{
+	thread_telemetry& current = current_telemetry;
+	if (__builtin_expect(current.row == nullptr, 0)) {
+		telemetry& t = get_telemetry();
+		current.group_bits = t.group_bits();
+		current.last_group = t.groups() - 1;
+		current.failures_offset = t.groups();
+		current.row = t.claim_row(current.shared);
+	}
+	return current;
+}
+
+inline void count(const thread_telemetry& current, unsigned index)
+{
+	if (__builtin_expect(current.shared, 0)) {
+		__atomic_fetch_add(&current.row[index], 1, __ATOMIC_RELAXED);
+	} else {
+		++current.row[index];
+	}
+}
+
+inline void count_check(unsigned id)
+{
+	if (__builtin_expect(!telemetry_enabled, 1)) {
+		return;
+	}
+	thread_telemetry& current = get_thread_telemetry();
+	count(current, std::min(id >> current.group_bits, current.last_group));
+}
+
+void count_failure(unsigned id)
+{
+	if (!telemetry_enabled) {
+		return;
+	}
+	thread_telemetry& current = get_thread_telemetry();
+	count(current, current.failures_offset + std::min(id >> current.group_bits, current.last_group));
+}
+
+// expected hashes of -oh-assert-mode=table, located (and a sidecar file
+// mapped) on the first check. OH_EXPECTED_FILE overrides the sidecar file
+// recorded in the program.
+class expected_table
+{
+public:
+	expected_table()
+		: table(nullptr)
+	{
+		const char* data = nullptr;
+		uint64_t size = 0;
+		if (__start_oh_expected != nullptr && __stop_oh_expected != nullptr) {
+			data = __start_oh_expected;
+			size = __stop_oh_expected - __start_oh_expected;
+		} else {
+			data = map_file(size);
+		}
+		const oh_expected::header* header = reinterpret_cast<const oh_expected::header*>(data);
+		if (data == nullptr || size < sizeof(oh_expected::header)
+				|| header->magic != oh_expected::magic
+				|| header->version != oh_expected::version
+				|| size < oh_expected::table_size(header->sites_count, header->values_count)) {
+			std::cerr << "oh: no valid expected hashes table\n";
+			abort();
+		}
+		table = header;
+	}
+
+	bool is_expected(unsigned id, uint64_t hash) const
+	{
+		if (id >= table->sites_count) {
+			return false;
+		}
+		const oh_expected::site_range& range = oh_expected::ranges(table)[id];
+		const uint64_t* begin = oh_expected::values(table) + range.begin;
+		return std::binary_search(begin, begin + range.count, hash);
+	}
+
+private:
+	static const char* map_file(uint64_t& size)
+	{
+		const char* file_name = getenv("OH_EXPECTED_FILE");
+		if (file_name == nullptr) {
+			file_name = oh_expected_file;
+		}
+		if (file_name == nullptr) {
+			return nullptr;
+		}
+		int fd = open(file_name, O_RDONLY);
+		if (fd < 0) {
+			std::cerr << "oh: cannot open " << file_name << "\n";
+			return nullptr;
+		}
+		struct stat file_stat;
+		void* memory = MAP_FAILED;
+		if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+			size = file_stat.st_size;
+			memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		close(fd);
+		return memory == MAP_FAILED ? nullptr : static_cast<const char*>(memory);
+	}
+
+	const oh_expected::header* table;
+};
+
+// the rings of the threads that checked, the verifier may start after the
+// first checks were queued
+std::atomic<verification_ring*> async_rings(nullptr);
+std::thread* async_verifier = nullptr;
+std::atomic<bool> async_stop(false);
+// set once the verifier is stopped, rings registered later start stopped
+std::atomic<bool> async_stopped(false);
+// whether the owners fence between raising active and reading stopped,
+// only when stop_verifier can not issue a process wide barrier
+bool async_fences = false;
+// checks dropped by the freed rings, verifier thread only
+uint64_t async_dropped = 0;
+
+// the calling thread's ring, handed to the verifier when the thread exits
+thread_local verification_ring* thread_ring = nullptr;
+thread_local bool thread_ring_exited = false;
+
+struct ring_owner
+{
+	~ring_owner()
+	{
+		thread_ring_exited = true;
+		if (thread_ring != nullptr) {
+			thread_ring->exited.store(true, std::memory_order_release);
+			thread_ring = nullptr;
+		}
+	}
+};
+
+// null once the thread exited, its checks are then verified inline
+verification_ring* get_thread_ring()
+{
+	if (__builtin_expect(thread_ring != nullptr, 1)) {
+		return thread_ring;
+	}
+	if (thread_ring_exited) {
+		return nullptr;
+	}
+	static thread_local ring_owner owner;
+	(void)owner;
+	verification_ring* ring = new verification_ring;
+	ring->next = async_rings.load();
+	while (!async_rings.compare_exchange_weak(ring->next, ring)) {
+	}
+	// pairs with stop_verifier: either it sees the ring or the ring starts
+	// stopped
+	if (async_stopped.load()) {
+		ring->stopped.store(true);
+	}
+	thread_ring = ring;
+	return ring;
+}
+
+// makes the owners' stores before the call visible, and their later loads
+// see the stores before it
+bool process_barrier()
+{
+	return syscall(__NR_membarrier, MEMBARRIER_CMD_SHARED, 0) == 0;
+}
+
+bool has_process_barrier()
+{
+	const long commands = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+	return commands > 0 && (commands & MEMBARRIER_CMD_SHARED) != 0;
+}
+
+void verify(unsigned id, uint64_t hash)
+{
+	count_check(id);
+	if (!is_expected(id, hash)) {
+		count_failure(id);
+		std::cout << "Fail for hashID:" << id << " computed: " << hash << std::endl;
+		abort();
+	}
+}
+
+void verify_pending(verification_ring& ring)
+{
+	unsigned id;
+	uint64_t hash;
+	while (ring.pop(id, hash)) {
+		verify(id, hash);
+	}
+}
+
+// drains every ring, frees the rings of exited threads. The first ring is
+// never unlinked, threads register in front of it.
+void verify_pending()
+{
+	verification_ring* previous = async_rings.load(std::memory_order_acquire);
+	if (previous == nullptr) {
+		return;
+	}
+	verify_pending(*previous);
+	while (verification_ring* ring = previous->next) {
+		const bool exited = ring->exited.load(std::memory_order_acquire);
+		verify_pending(*ring);
+		if (exited) {
+			async_dropped += ring->dropped_count();
+			previous->next = ring->next;
+			delete ring;
+			continue;
+		}
+		previous = ring;
+	}
+}
+
+// how long the verifier sleeps on an empty ring, bounds the detection delay
+std::chrono::microseconds async_poll_interval()
+{
+	const char* env = getenv("OH_ASYNC_POLL_US");
+	return std::chrono::microseconds(env ? strtoul(env, nullptr, 10) : 100);
+}
+
+void run_verifier()
+{
+	const auto poll_interval = async_poll_interval();
+	while (!async_stop.load(std::memory_order_acquire)) {
+		verify_pending();
+		std::this_thread::sleep_for(poll_interval);
+	}
+	verify_pending();
+}
+
+void stop_verifier()
+{
+	async_stop.store(true, std::memory_order_release);
+	async_verifier->join();
+	// the owners raise active before reading stopped: after the barrier an
+	// owner either sees stopped or its push is waited for below
+	async_stopped.store(true);
+	verification_ring* rings = async_rings.load();
+	for (verification_ring* ring = rings; ring != nullptr; ring = ring->next) {
+		ring->stopped.store(true, std::memory_order_relaxed);
+	}
+	if (!async_fences) {
+		process_barrier();
+	} else {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+	uint64_t dropped = async_dropped;
+	for (verification_ring* ring = rings; ring != nullptr; ring = ring->next) {
+		while (ring->active.load(std::memory_order_acquire)) {
+			std::this_thread::yield();
+		}
+		verify_pending(*ring);
+		dropped += ring->dropped_count();
+	}
+	if (dropped != 0) {
+		std::cerr << "oh: " << dropped << " checks dropped by the verifier\n";
+	}
+}
+
+}
+
 extern "C" {
 
 	void assert_(uint64_t* hashVar, uint64_t hash)
@@ -28,6 +577,8 @@ extern "C" {
 		uint64_t hash = 0;
 		va_list args_list;
 		va_start(args_list, values_count);
+		// with thread local hash variables every thread dumps its own hash
+		std::lock_guard<std::mutex> lock(dumper_mutex);
 		std::ofstream log_stream;
 		log_stream.open("hashes_dumper.log", std::ofstream::out|std::ofstream::app);
 		log_stream << id << " " << *hashVar << "\n";
@@ -51,12 +602,97 @@ extern "C" {
 	}
 
 
+	// reached from the cold block of an inline check (-oh-assert-mode=inline)
+	__attribute__((cold, noreturn, noinline))
+	void oh_assert_failed(unsigned id, uint64_t* hashVar)
+	{
+		count_check(id);
+		count_failure(id);
+		std::cout << "Fail for hashID:" << id << " computed: " << *hashVar << std::endl;
+		abort();
+	}
+
+	// called once from the module constructor of programs finalized with
+	// -oh-assert-mode=async, starts the verifier thread
+	void oh_register_expected_hashes(const uint32_t* offsets, const uint64_t* values, unsigned sites_count)
+	{
+		expected_offsets = offsets;
+		expected_values = values;
+		expected_sites_count = sites_count;
+		if (async_verifier != nullptr) {
+			return;
+		}
+		async_fences = !has_process_barrier();
+		async_verifier = new std::thread(run_verifier);
+		atexit(stop_verifier);
+	}
+
+	// passed inline checks of programs finalized with -oh-telemetry
+	void oh_telemetry_check(unsigned id)
+	{
+		count_check(id);
+	}
+
+	// sites finalized with -oh-assert-mode=table
+	void oh_assert_table(unsigned id, uint64_t* hashVar)
+	{
+		static const expected_table table;
+		count_check(id);
+		if (__builtin_expect(!table.is_expected(id, *hashVar), 0)) {
+			count_failure(id);
+			std::cout << "Fail for hashID:" << id << " computed: " << *hashVar << std::endl;
+			abort();
+		}
+	}
+
+	// only touches the calling thread's ring: raising active, the push and
+	// lowering active are plain stores on x86, the fence is only needed when
+	// the kernel has no membarrier
+	void oh_assert_async(unsigned id, uint64_t hash)
+	{
+		verification_ring* ring = get_thread_ring();
+		if (__builtin_expect(ring != nullptr, 1)) {
+			ring->active.store(true, std::memory_order_relaxed);
+			if (__builtin_expect(async_fences, 0)) {
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+			} else {
+				std::atomic_signal_fence(std::memory_order_seq_cst);
+			}
+			if (__builtin_expect(!ring->stopped.load(std::memory_order_relaxed), 1)) {
+				ring->push(id, hash);
+				ring->active.store(false, std::memory_order_release);
+				return;
+			}
+			ring->active.store(false, std::memory_order_relaxed);
+		}
+		verify(id, hash);
+	}
+
+	// called after a passed sampled check, returns the number of executions
+	// to skip before the site is checked again
+	unsigned oh_sample_rearm(unsigned id, unsigned rate, unsigned backoff, unsigned max_interval)
+	{
+		if (sample_states.size() <= id) {
+			sample_states.resize(2 * (id + 1), sample_state{0, 0});
+		}
+		auto& state = sample_states[id];
+		if (state.interval == 0) {
+			state.interval = rate;
+		}
+		if (++state.passes >= backoff) {
+			state.passes = 0;
+			state.interval = std::min(2 * state.interval, std::max(rate, max_interval));
+		}
+		return state.interval - 1;
+	}
+
 	void oh_assert_finalize(unsigned id, uint64_t* hashVar, int values_count, ...)
 	{
 		if (hashVar == nullptr) {
 			std::cout << "Pass\n";
 			return;
 		}
+		count_check(id);
 		bool is_valid = false;
 		uint64_t hash = 0;
 		va_list args_list;
@@ -72,6 +708,7 @@ extern "C" {
 			//if (hash == 272) {
 			//    return;
 			//}
+			count_failure(id);
 			std::cout << "Fail for hashID:"<<id << " computed: " << *hashVar << " != last expected " << hash << "\n";
 			abort();
 		}
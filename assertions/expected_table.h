@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+// layout of the expected hashes table written by -insert-asserts-finalize
+// with -oh-assert-mode=table, into the oh_expected section of the program or
+// a sidecar file, and read by oh_assert_table (see asserts.cpp).
+//
+// The header is followed by sites_count ranges and values_count hashes. Site
+// id expects one of values[begin, begin + count) of its range; the values of
+// a range are sorted and sites with the same candidates share one range.
+namespace oh_expected {
+
+const uint32_t magic = 0x6f686531;  // "ohe1"
+const uint32_t version = 1;
+
+struct header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sites_count;
+	uint32_t values_count;
+};
+
+struct site_range
+{
+	uint32_t begin;
+	uint32_t count;
+};
+
+inline uint64_t table_size(uint32_t sites_count, uint32_t values_count)
+{
+	return sizeof(header) + uint64_t(sites_count) * sizeof(site_range) + uint64_t(values_count) * sizeof(uint64_t);
+}
+
+inline const site_range* ranges(const header* table)
+{
+	return reinterpret_cast<const site_range*>(table + 1);
+}
+
+inline const uint64_t* values(const header* table)
+{
+	return reinterpret_cast<const uint64_t*>(ranges(table) + table->sites_count);
+}
+
+}
@@ -2,69 +2,336 @@
 #include <fstream>
 #include <vector>
 #include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <cstdlib>
+#include <cstdio>
+#include <stdint.h>
 
-class logger
+// distinct hashes seen by one logging site, a small open addressing set
+// which grows up to the logger's cap
+class site_hashes
 {
 public:
-    logger()
-        : max_log_count(2)
+    site_hashes()
+        : count(0)
+        , has_zero(false)
+        , saturated(false)
     {
-        log_stream.open("hashes.log", std::ofstream::out|std::ofstream::trunc);
-	log_stream.flush();
-	log_stream.close();
     }
 
-    void log(unsigned id, uint64_t hash)
+    // returns false once the site saw more than max_count distinct hashes
+    bool insert(uint64_t hash, unsigned max_count)
     {
-        log_stream.open("hashes.log", std::ofstream::out|std::ofstream::app);
-        log_stream << id << " " << hash << "\n";
-	log_stream.flush();
-	log_stream.close();
+        if (saturated) {
+            return false;
+        }
+        if (hash == 0) {
+            // 0 marks empty slots
+            if (!has_zero) {
+                has_zero = true;
+                return add_count(max_count);
+            }
+            return true;
+        }
+        if (slots.empty()) {
+            slots.resize(4, 0);
+        }
+        if (!insert_slot(hash)) {
+            return true;
+        }
+        if (!add_count(max_count)) {
+            return false;
+        }
+        if (2 * count > slots.size()) {
+            grow();
+        }
+        return true;
+    }
+
+    unsigned size() const
+    {
+        return count;
+    }
+
+    bool is_saturated() const
+    {
+        return saturated;
+    }
+
+    // too many values to make a useful assertion, forget the site
+    void saturate()
+    {
+        saturated = true;
+        std::vector<uint64_t>().swap(slots);
+        has_zero = false;
+    }
+
+    template <typename Func>
+    void for_each(Func func) const
+    {
+        if (has_zero) {
+            func(0);
+        }
+        for (const auto& slot : slots) {
+            if (slot != 0) {
+                func(slot);
+            }
+        }
+    }
+
+private:
+    // returns true if the hash was not in the set
+    bool insert_slot(uint64_t hash)
+    {
+        const size_t mask = slots.size() - 1;
+        size_t pos = (hash * 0x9E3779B97F4A7C15ull) >> 32 & mask;
+        while (slots[pos] != 0) {
+            if (slots[pos] == hash) {
+                return false;
+            }
+            pos = (pos + 1) & mask;
+        }
+        slots[pos] = hash;
+        return true;
+    }
+
+    bool add_count(unsigned max_count)
+    {
+        if (++count > max_count) {
+            saturate();
+            return false;
+        }
+        return true;
+    }
+
+    void grow()
+    {
+        std::vector<uint64_t> old_slots(2 * slots.size(), 0);
+        old_slots.swap(slots);
+        for (const auto& slot : old_slots) {
+            if (slot != 0) {
+                insert_slot(slot);
+            }
+        }
+    }
+
+private:
+    std::vector<uint64_t> slots;
+    unsigned count;
+    bool has_zero;
+    bool saturated;
+};
+
+class logger;
+
+// distinct hashes logged by the current thread. Only the owning thread
+// touches them, without any synchronization; they are handed over to the
+// logger when the thread exits, or merged by finish if the thread calls it.
+static thread_local std::vector<site_hashes>* thread_sites = nullptr;
+static thread_local bool thread_exited = false;
+// distinct hashes the current thread added since its last checkpoint
+static thread_local unsigned thread_new_hashes = 0;
+
+// constructed when a thread logs for the first time
+struct thread_exit
+{
+    ~thread_exit();
+};
+
+// collects distinct (id, hash) pairs in memory and writes them once at exit,
+// so the training log grows with the number of distinct values instead of
+// the number of executions. Sites producing more than OH_LOG_MAX_HASHES
+// (default 16) distinct values are left out of the log and get no assertion.
+// Logging only touches the calling thread's buffer; the mutex is taken when
+// a thread exits and hands its buffer over, by finish, and by checkpoints.
+// A thread that added OH_LOG_CHECKPOINT (default 256, 0 disables) new
+// distinct hashes merges its buffer and rewrites hashes.log, so a crashed or
+// killed training run keeps what it logged up to the last checkpoint.
+class logger
+{
+public:
+    // never destroyed, threads exiting after finish still find the logger
+    static logger& get()
+    {
+        static logger* instance = new logger;
+        return *instance;
     }
 
-    void log_with_max_count(unsigned id, uint64_t hash)
+    void log(unsigned id, uint64_t hash)
     {
-        unsigned size = log_counts.size();
-//        printf("size %d\n", size);
-        if (size <= id) {
+        if (finished.load(std::memory_order_relaxed)) {
+            return;
+        }
+        std::vector<site_hashes>& local = get_thread_sites();
+        if (local.size() <= id) {
             try {
-                log_counts.resize(2 * (id + 1));
+                local.resize(2 * (id + 1));
             } catch (const std::exception& e) {
                 return;
             }
         }
-        try {
-            if (log_counts.at(id) >= max_log_count) {
-                return;
-            }
-        } catch (const std::out_of_range& oor) {
-            printf("out of range for for id %d\n", id);
-            return;
+        site_hashes& site = local[id];
+        const unsigned site_count = site.size();
+        site.insert(hash, max_log_count);
+        if (site.size() != site_count
+                && ++thread_new_hashes == checkpoint_interval) {
+            checkpoint(local);
         }
-        //if (log_counts[id] >= max_log_count) {
-        //    return;
-        //}
-        //printf("logging: id %u hash %lu\n", id, hash);
-        log_stream << id << " " << hash << "\n";
-        ++log_counts[id];
     }
 
+    void hand_over(const std::vector<site_hashes>& local)
+    {
+        std::lock_guard<std::mutex> lock(merge_mutex);
+        if (!finished.load(std::memory_order_relaxed)) {
+            merge(local);
+            ++threads_count;
+        }
+    }
+
+    // merges the calling thread's hashes; the hashes of threads still running
+    // are lost, as are the hashes logged after finish
     void finish()
     {
+        std::lock_guard<std::mutex> lock(merge_mutex);
+        if (finished.exchange(true)) {
+            return;
+        }
+        if (thread_sites != nullptr) {
+            merge(*thread_sites);
+            ++threads_count;
+        }
         printf("finish\n");
+        const unsigned saturated_count = write_log();
+        if (threads_count > 1) {
+            printf("merged the hashes of %u threads\n", threads_count);
+        }
+        if (saturated_count != 0) {
+            printf("%u sites exceeded %u distinct hashes and were not logged\n",
+                   saturated_count, max_log_count);
+        }
+    }
+
+private:
+    logger()
+        : max_log_count(read_unsigned("OH_LOG_MAX_HASHES", 16))
+        , checkpoint_interval(read_unsigned("OH_LOG_CHECKPOINT", 256))
+        , finished(false)
+        , threads_count(0)
+    {
+        log_stream.open("hashes.log", std::ofstream::out|std::ofstream::trunc);
+	log_stream.flush();
+	log_stream.close();
+        atexit(finish_at_exit);
+    }
+
+    // merges the buffer of a running thread, merging it again later only
+    // adds the hashes it gained since
+    void checkpoint(const std::vector<site_hashes>& local)
+    {
+        thread_new_hashes = 0;
+        std::lock_guard<std::mutex> lock(merge_mutex);
+        if (!finished.load(std::memory_order_relaxed)) {
+            merge(local);
+            write_log();
+        }
+    }
+
+    // writes the merged hashes next to hashes.log and renames the file over
+    // it, a run killed while writing leaves the previous log. Returns the
+    // number of saturated sites.
+    unsigned write_log()
+    {
+        unsigned saturated_count = 0;
+        log_stream.open("hashes.log.part",
+                        std::ofstream::out|std::ofstream::trunc);
+        for (unsigned id = 0; id < sites.size(); ++id) {
+            if (sites[id].is_saturated()) {
+                ++saturated_count;
+                continue;
+            }
+            sites[id].for_each([this, id] (uint64_t hash) {
+                log_stream << id << " " << hash << "\n";
+            });
+        }
         log_stream.close();
+        if (rename("hashes.log.part", "hashes.log") != 0) {
+            std::cerr << "oh: cannot write hashes.log\n";
+        }
+        return saturated_count;
+    }
+
+    static void finish_at_exit()
+    {
+        get().finish();
+    }
+
+    static unsigned read_unsigned(const char* name, unsigned default_value)
+    {
+        const char* env = getenv(name);
+        return env ? strtoul(env, nullptr, 10) : default_value;
+    }
+
+    std::vector<site_hashes>& get_thread_sites()
+    {
+        if (thread_sites == nullptr) {
+            thread_sites = new std::vector<site_hashes>;
+            // a thread logging from its thread local destructors keeps the
+            // new buffer until it calls finish
+            if (!thread_exited) {
+                static thread_local thread_exit on_exit;
+                (void)on_exit;
+            }
+        }
+        return *thread_sites;
+    }
+
+    // a site saturated in one thread, or by the union of all threads'
+    // hashes, stays saturated
+    void merge(const std::vector<site_hashes>& local)
+    {
+        if (sites.size() < local.size()) {
+            sites.resize(local.size());
+        }
+        for (unsigned id = 0; id < local.size(); ++id) {
+            site_hashes& site = sites[id];
+            if (local[id].is_saturated()) {
+                site.saturate();
+                continue;
+            }
+            local[id].for_each([this, &site] (uint64_t hash) {
+                site.insert(hash, max_log_count);
+            });
+        }
     }
 
 private:
     std::ofstream log_stream;
     unsigned max_log_count;
-    std::vector<unsigned> log_counts;
+    unsigned checkpoint_interval;
+    std::atomic<bool> finished;
+    std::mutex merge_mutex;
+    std::vector<site_hashes> sites;
+    unsigned threads_count;
 };
+
+thread_exit::~thread_exit()
+{
+    thread_exited = true;
+    if (thread_sites != nullptr) {
+        logger::get().hand_over(*thread_sites);
+        delete thread_sites;
+        thread_sites = nullptr;
+    }
+}
+
 extern "C" {
 
+// hashVar points to the calling thread's copy when the hash variables are
+// thread local (-oh-thread-local-hashes), every thread logs its own hashes
 void oh_log(unsigned id, uint64_t* hashVar)
 {
-    static logger _logger;
+    logger& _logger = logger::get();
     if (hashVar == NULL) {
         _logger.finish();
         return;
@@ -72,7 +339,9 @@ void oh_log(unsigned id, uint64_t* hashVar)
     _logger.log(id, *hashVar);
 }
 
-void oh_input_dep_log(uint64_t* hashVar, uint64_t hashVal)
+// logger of a site whose hash was computed at compile time
+// (-oh-precompute-constants), nothing to train
+void oh_input_dep_log(unsigned id, uint64_t* hashVar, uint64_t hashVal)
 {
     //printf("Hash variable %lu prcumputed hash %lu\n", *hashVar, hashVal);
     // dummy function. only for assertion inserter to change to assert
@@ -0,0 +1,94 @@
+#include <iostream>
+#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// runtime of programs instrumented with -oh-profile. Every hash update and
+// logger site counts its hits; with OH_PROFILE_CYCLES=N every Nth hit of a
+// site also measures the cycles spent in the site.
+namespace {
+
+struct site_profile
+{
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> cycles;
+    std::atomic<uint64_t> samples;
+};
+
+site_profile* profiles = nullptr;
+unsigned profiles_count = 0;
+uint64_t sample_period = 0;
+
+uint64_t read_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// one line per executed site: id hits cycles samples
+void write_profile()
+{
+    const char* file_name = std::getenv("OH_PROFILE_FILE");
+    std::ofstream profile_file(file_name ? file_name : "oh_profile.log");
+    uint64_t total_hits = 0;
+    for (unsigned id = 0; id < profiles_count; ++id) {
+        const uint64_t hits = profiles[id].hits.load(std::memory_order_relaxed);
+        if (hits == 0) {
+            continue;
+        }
+        total_hits += hits;
+        profile_file << id << " " << hits << " "
+                     << profiles[id].cycles.load(std::memory_order_relaxed) << " "
+                     << profiles[id].samples.load(std::memory_order_relaxed) << "\n";
+    }
+    std::cerr << "oh profile: " << total_hits << " site hits\n";
+}
+}
+
+extern "C" {
+
+// called by the module constructor with the number of profiled sites
+void oh_profile_init(unsigned sites_count)
+{
+    if (profiles != nullptr) {
+        return;
+    }
+    profiles = new site_profile[sites_count]();
+    profiles_count = sites_count;
+    if (const char* period = std::getenv("OH_PROFILE_CYCLES")) {
+        sample_period = std::strtoull(period, nullptr, 10);
+    }
+    std::atexit(write_profile);
+}
+
+uint64_t oh_profile_begin(unsigned id)
+{
+    if (id >= profiles_count) {
+        return 0;
+    }
+    const uint64_t hits = profiles[id].hits.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (sample_period == 0 || hits % sample_period != 0) {
+        return 0;
+    }
+    return read_cycles();
+}
+
+void oh_profile_end(unsigned id, uint64_t start)
+{
+    if (start == 0 || id >= profiles_count) {
+        return;
+    }
+    profiles[id].cycles.fetch_add(read_cycles() - start, std::memory_order_relaxed);
+    profiles[id].samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+// layout of the shared memory segment the assertion runtime keeps its check
+// counters in when OH_TELEMETRY is set (see asserts.cpp), read by
+// tools/oh-telemetry.
+//
+// The header is followed by rows_count rows, each thread of the program
+// counts into its own row. A row holds groups_count check counters followed
+// by groups_count failure counters; site id belongs to group
+// min(id >> group_bits, groups_count - 1).
+namespace oh_telemetry {
+
+const uint32_t magic = 0x6f687431;  // "oht1"
+const uint32_t version = 1;
+
+struct header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rows_count;
+	uint32_t groups_count;
+	uint32_t group_bits;
+	// rows claimed by threads, threads beyond rows_count share the last row
+	uint32_t rows_used;
+	uint64_t pid;
+};
+
+inline uint64_t segment_size(uint32_t rows_count, uint32_t groups_count)
+{
+	return sizeof(header) + uint64_t(rows_count) * groups_count * 2 * sizeof(uint64_t);
+}
+
+inline uint64_t* row(header* segment, uint32_t index)
+{
+	return reinterpret_cast<uint64_t*>(segment + 1) + uint64_t(index) * segment->groups_count * 2;
+}
+
+}
@@ -0,0 +1,245 @@
+// Generates synthetic bitcode for compile time scaling measurements of the
+// oblivious hashing passes.
+//
+// Every function f<i>(i32 x) keeps an accumulator in an alloca (the shape
+// clang emits at -O0) and consists of a chain of blocks updating it. Blocks
+// branch either on the accumulator (input independent) or on x (input
+// dependent), may contain a loop nest with constant trip counts and call
+// functions with a higher index, directly or through a function pointer table.
+// A global call budget bounds the number of executed calls, so the generated
+// program also runs in reasonable time for training.
+
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+static llvm::cl::opt<unsigned>
+    num_functions("functions", llvm::cl::desc("Number of functions"),
+                  llvm::cl::init(100));
+
+static llvm::cl::opt<unsigned>
+    blocks_per_function("blocks", llvm::cl::desc("Blocks per function"),
+                        llvm::cl::init(10));
+
+static llvm::cl::opt<unsigned>
+    loop_depth("loop-depth",
+               llvm::cl::desc("Depth of the loop nest put in every fourth block"),
+               llvm::cl::init(1));
+
+static llvm::cl::opt<double> call_density(
+    "call-density",
+    llvm::cl::desc("Probability of a block calling another function"),
+    llvm::cl::init(0.2));
+
+static llvm::cl::opt<double> indirect_calls(
+    "indirect-calls",
+    llvm::cl::desc("Fraction of calls made through a function pointer table"),
+    llvm::cl::init(0.1));
+
+static llvm::cl::opt<unsigned> call_budget(
+    "call-budget",
+    llvm::cl::desc("Maximum number of calls executed by the generated program"),
+    llvm::cl::init(100000));
+
+static llvm::cl::opt<unsigned> seed("seed", llvm::cl::desc("Random seed"),
+                                    llvm::cl::init(1));
+
+static llvm::cl::opt<std::string> output("o", llvm::cl::desc("Output bitcode"),
+                                         llvm::cl::value_desc("filename"),
+                                         llvm::cl::Required);
+
+namespace {
+
+class module_generator {
+public:
+  module_generator(llvm::Module &M)
+      : M(M), Ctx(M.getContext()), int32_ty(llvm::Type::getInt32Ty(Ctx)),
+        gen(seed) {}
+
+  void generate() {
+    auto *function_type =
+        llvm::FunctionType::get(int32_ty, {int32_ty}, false);
+    for (unsigned i = 0; i < num_functions; ++i) {
+      functions.push_back(llvm::Function::Create(
+          function_type, llvm::GlobalValue::InternalLinkage,
+          "f" + std::to_string(i), &M));
+    }
+    budget = new llvm::GlobalVariable(
+        M, int32_ty, false, llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantInt::get(int32_ty, call_budget), "call_budget");
+    auto *table_type =
+        llvm::ArrayType::get(function_type->getPointerTo(), functions.size());
+    std::vector<llvm::Constant *> table_entries(functions.begin(),
+                                                functions.end());
+    table = new llvm::GlobalVariable(
+        M, table_type, true, llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantArray::get(table_type, table_entries), "call_table");
+
+    for (unsigned i = 0; i < functions.size(); ++i) {
+      generate_function(i);
+    }
+    generate_main();
+  }
+
+private:
+  unsigned random(unsigned range) {
+    return std::uniform_int_distribution<unsigned>(0, range - 1)(gen);
+  }
+
+  bool chance(double probability) {
+    return std::uniform_real_distribution<double>(0, 1)(gen) < probability;
+  }
+
+  llvm::Value *add_to_acc(llvm::IRBuilder<> &builder, llvm::Value *acc,
+                          llvm::Value *value) {
+    llvm::Value *sum = builder.CreateAdd(builder.CreateLoad(acc), value);
+    builder.CreateStore(sum, acc);
+    return sum;
+  }
+
+  // for (i = 0; i < 4; ++i) { body } nested depth times
+  void generate_loop_nest(llvm::IRBuilder<> &builder, llvm::Function *F,
+                          llvm::Value *acc, unsigned depth) {
+    if (depth == 0) {
+      add_to_acc(builder, acc, builder.getInt32(random(100)));
+      return;
+    }
+    llvm::IRBuilder<> entry_builder(&F->getEntryBlock(),
+                                    F->getEntryBlock().begin());
+    llvm::Value *counter = entry_builder.CreateAlloca(int32_ty);
+    builder.CreateStore(builder.getInt32(0), counter);
+    auto *header = llvm::BasicBlock::Create(Ctx, "loop.header", F);
+    auto *body = llvm::BasicBlock::Create(Ctx, "loop.body", F);
+    auto *exit = llvm::BasicBlock::Create(Ctx, "loop.exit", F);
+    builder.CreateBr(header);
+
+    builder.SetInsertPoint(header);
+    builder.CreateCondBr(
+        builder.CreateICmpSLT(builder.CreateLoad(counter), builder.getInt32(4)),
+        body, exit);
+
+    builder.SetInsertPoint(body);
+    generate_loop_nest(builder, F, acc, depth - 1);
+    builder.CreateStore(
+        builder.CreateAdd(builder.CreateLoad(counter), builder.getInt32(1)),
+        counter);
+    builder.CreateBr(header);
+
+    builder.SetInsertPoint(exit);
+  }
+
+  void generate_call(llvm::IRBuilder<> &builder, unsigned caller,
+                     llvm::Value *acc, llvm::Value *x) {
+    if (caller + 1 >= functions.size()) {
+      return;
+    }
+    unsigned callee = caller + 1 + random(functions.size() - caller - 1);
+    llvm::Value *target = functions[callee];
+    if (chance(indirect_calls)) {
+      target = builder.CreateLoad(builder.CreateConstInBoundsGEP2_32(
+          table->getValueType(), table, 0, callee));
+    }
+    add_to_acc(builder, acc, builder.CreateCall(target, {x}));
+  }
+
+  void generate_function(unsigned index) {
+    llvm::Function *F = functions[index];
+    llvm::Value *x = &*F->arg_begin();
+    auto *entry = llvm::BasicBlock::Create(Ctx, "entry", F);
+    auto *ret_block = llvm::BasicBlock::Create(Ctx, "return", F);
+    std::vector<llvm::BasicBlock *> blocks;
+    for (unsigned b = 0; b < blocks_per_function; ++b) {
+      blocks.push_back(llvm::BasicBlock::Create(Ctx, "block", F, ret_block));
+    }
+    blocks.push_back(ret_block);
+
+    llvm::IRBuilder<> builder(entry);
+    llvm::Value *acc = builder.CreateAlloca(int32_ty);
+    builder.CreateStore(builder.getInt32(index), acc);
+    // spend one unit of the call budget, return immediately when exhausted
+    llvm::Value *left = builder.CreateLoad(budget);
+    builder.CreateStore(builder.CreateSub(left, builder.getInt32(1)), budget);
+    builder.CreateCondBr(builder.CreateICmpSGT(left, builder.getInt32(0)),
+                         blocks[0], ret_block);
+
+    for (unsigned b = 0; b + 1 < blocks.size(); ++b) {
+      builder.SetInsertPoint(blocks[b]);
+      llvm::Value *sum = add_to_acc(builder, acc, builder.getInt32(random(1000)));
+      if (loop_depth > 0 && b % 4 == 3) {
+        generate_loop_nest(builder, F, acc, loop_depth);
+      }
+      if (chance(call_density)) {
+        generate_call(builder, index, acc, x);
+      }
+      // input dependent branch every third block, input independent otherwise
+      llvm::Value *cond =
+          b % 3 == 0
+              ? builder.CreateICmpSGT(x, builder.getInt32(random(4)))
+              : builder.CreateICmpEQ(builder.CreateAnd(sum, builder.getInt32(1)),
+                                     builder.getInt32(0));
+      llvm::BasicBlock *skip = blocks[std::min<size_t>(b + 2, blocks.size() - 1)];
+      builder.CreateCondBr(cond, blocks[b + 1], skip);
+    }
+
+    builder.SetInsertPoint(ret_block);
+    builder.CreateRet(builder.CreateLoad(acc));
+  }
+
+  void generate_main() {
+    auto *main_type = llvm::FunctionType::get(
+        int32_ty, {int32_ty, llvm::Type::getInt8PtrTy(Ctx)->getPointerTo()},
+        false);
+    auto *main = llvm::Function::Create(
+        main_type, llvm::GlobalValue::ExternalLinkage, "main", &M);
+    llvm::Value *argc = &*main->arg_begin();
+    llvm::IRBuilder<> builder(llvm::BasicBlock::Create(Ctx, "entry", main));
+    llvm::Value *result = builder.getInt32(0);
+    // call every function once so all of them run during training
+    for (auto *F : functions) {
+      result = builder.CreateXor(result, builder.CreateCall(F, {argc}));
+    }
+    builder.CreateRet(builder.CreateAnd(result, builder.getInt32(0)));
+  }
+
+private:
+  llvm::Module &M;
+  llvm::LLVMContext &Ctx;
+  llvm::Type *int32_ty;
+  std::mt19937 gen;
+  std::vector<llvm::Function *> functions;
+  llvm::GlobalVariable *budget;
+  llvm::GlobalVariable *table;
+};
+}
+
+int main(int argc, char **argv) {
+  llvm::cl::ParseCommandLineOptions(argc, argv,
+                                    "synthetic module generator\n");
+  llvm::LLVMContext Ctx;
+  llvm::Module M("synthetic", Ctx);
+  module_generator(M).generate();
+  if (llvm::verifyModule(M, &llvm::errs())) {
+    return 1;
+  }
+  std::error_code EC;
+  llvm::raw_fd_ostream out(output, EC, llvm::sys::fs::F_None);
+  if (EC) {
+    llvm::errs() << "cannot open " << output << ": " << EC.message() << "\n";
+    return 1;
+  }
+  llvm::WriteBitcodeToFile(&M, out);
+  return 0;
+}
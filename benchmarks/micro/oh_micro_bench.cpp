@@ -0,0 +1,303 @@
+// Microbenchmarks for the oblivious hashing runtime: hash kernels, assertion
+// checks and the training logger, plus basic quality metrics of the kernels.
+// Every measurement is printed as one JSON object per line.
+//
+// usage: oh-micro-bench [iterations]
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" {
+void hash1(uint64_t *hashVar, uint64_t value);
+void hash2(uint64_t *hashVar, uint64_t value);
+#define OH_DECLARE_HASHES(name)                                                \
+  void name##_i8(uint64_t *hashVar, uint8_t value);                            \
+  void name##_i16(uint64_t *hashVar, uint16_t value);                          \
+  void name##_i32(uint64_t *hashVar, uint32_t value);                          \
+  void name##_i64(uint64_t *hashVar, uint64_t value);                          \
+  void name##_f32(uint64_t *hashVar, float value);                             \
+  void name##_f64(uint64_t *hashVar, double value);
+OH_DECLARE_HASHES(hash1)
+OH_DECLARE_HASHES(hash2)
+uint64_t hash_assoc_term(uint64_t key, uint64_t value);
+void oh_assert_finalize(unsigned id, uint64_t *hashVar, int values_count, ...);
+void oh_log(unsigned id, uint64_t *hashVar);
+}
+
+namespace {
+
+// a hash update at site `site`, the sites of a stream are its positions
+using hash_kernel = void (*)(uint64_t *, uint64_t, unsigned site);
+
+struct kernel_info {
+  const char *name;
+  hash_kernel kernel;
+};
+
+void hash1_site(uint64_t *hashVar, uint64_t value, unsigned) {
+  hash1(hashVar, value);
+}
+
+void hash2_site(uint64_t *hashVar, uint64_t value, unsigned) {
+  hash2(hashVar, value);
+}
+
+// the update -oh-hash-family=assoc inlines. The pass draws a random key per
+// site, here it is derived from the site with splitmix64.
+void hash_assoc(uint64_t *hashVar, uint64_t value, unsigned site) {
+  uint64_t key = (site + 1) * 0x9e3779b97f4a7c15ULL;
+  key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  *hashVar += hash_assoc_term(key % 0x1ffffffffffffffeULL + 1, value);
+}
+
+// 64 bit kernels, used for the quality metrics
+const kernel_info kernels[] = {{"hash1", hash1_site},
+                               {"hash2", hash2_site},
+                               {"hash_assoc", hash_assoc}};
+
+// width specialized entry points the pass calls for each value type
+template <typename T> struct entry_point {
+  const char *name;
+  const char *param;
+  void (*kernel)(uint64_t *, T);
+};
+
+volatile uint64_t sink;
+
+class stopwatch {
+public:
+  stopwatch() : start(std::chrono::steady_clock::now()) {}
+
+  double ns_per(uint64_t count) const {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / count;
+  }
+
+private:
+  std::chrono::steady_clock::time_point start;
+};
+
+void report(const char *group, const char *name, const std::string &param,
+            const char *metric, double value) {
+  printf("{\"group\": \"%s\", \"name\": \"%s\", \"param\": \"%s\", "
+         "\"metric\": \"%s\", \"value\": %.4f}\n",
+         group, name, param.c_str(), metric, value);
+}
+
+template <typename T>
+std::vector<T> random_values(size_t count, uint64_t seed) {
+  std::mt19937_64 gen(seed);
+  std::vector<T> values(count);
+  for (auto &value : values) {
+    const uint64_t bits = gen();
+    memcpy(&value, &bits, sizeof(T));
+  }
+  return values;
+}
+
+// latency: every update depends on the previous one through the hash variable
+// throughput: four independent hash variables updated round robin
+template <typename T>
+void bench_entry_point(const entry_point<T> &entry, uint64_t iterations) {
+  const size_t pool_size = 4096;
+  const auto values = random_values<T>(pool_size, sizeof(T));
+  uint64_t hash = 0;
+  stopwatch latency_watch;
+  for (uint64_t i = 0; i < iterations; ++i) {
+    // the index depends on the hash, so updates can not overlap
+    entry.kernel(&hash, values[(i + (hash & 1)) & (pool_size - 1)]);
+  }
+  const double latency = latency_watch.ns_per(iterations);
+  sink = hash;
+
+  uint64_t hashes[4] = {0, 0, 0, 0};
+  stopwatch throughput_watch;
+  for (uint64_t i = 0; i < iterations; i += 4) {
+    entry.kernel(&hashes[0], values[i & (pool_size - 1)]);
+    entry.kernel(&hashes[1], values[(i + 1) & (pool_size - 1)]);
+    entry.kernel(&hashes[2], values[(i + 2) & (pool_size - 1)]);
+    entry.kernel(&hashes[3], values[(i + 3) & (pool_size - 1)]);
+  }
+  const double ns = throughput_watch.ns_per(iterations);
+  sink = hashes[0] ^ hashes[1] ^ hashes[2] ^ hashes[3];
+
+  report("kernel", entry.name, entry.param, "latency_ns", latency);
+  report("kernel", entry.name, entry.param, "ns_per_update", ns);
+  report("kernel", entry.name, entry.param, "mupdates_per_s", 1e3 / ns);
+}
+
+#define OH_BENCH_ENTRY_POINTS(name, iterations)                                \
+  bench_entry_point<uint8_t>({#name, "i8", name##_i8}, iterations);            \
+  bench_entry_point<uint16_t>({#name, "i16", name##_i16}, iterations);         \
+  bench_entry_point<uint32_t>({#name, "i32", name##_i32}, iterations);         \
+  bench_entry_point<uint64_t>({#name, "i64", name##_i64}, iterations);         \
+  bench_entry_point<float>({#name, "f32", name##_f32}, iterations);            \
+  bench_entry_point<double>({#name, "f64", name##_f64}, iterations);
+
+void bench_kernels(uint64_t iterations) {
+  OH_BENCH_ENTRY_POINTS(hash1, iterations)
+  OH_BENCH_ENTRY_POINTS(hash2, iterations)
+}
+
+// passing checks, the matching hash is the last candidate
+template <typename Check>
+void bench_assert(const char *name, unsigned candidates, uint64_t iterations,
+                  Check check) {
+  uint64_t hash = 16;
+  stopwatch watch;
+  for (uint64_t i = 0; i < iterations; ++i) {
+    check(&hash);
+  }
+  report("assert", name, std::to_string(candidates), "ns_per_check",
+         watch.ns_per(iterations));
+}
+
+void bench_asserts(uint64_t iterations) {
+  bench_assert("oh_assert_finalize", 1, iterations, [](uint64_t *hash) {
+    oh_assert_finalize(0, hash, 1, 16ull);
+  });
+  bench_assert("oh_assert_finalize", 2, iterations, [](uint64_t *hash) {
+    oh_assert_finalize(0, hash, 2, 1ull, 16ull);
+  });
+  bench_assert("oh_assert_finalize", 4, iterations, [](uint64_t *hash) {
+    oh_assert_finalize(0, hash, 4, 1ull, 2ull, 3ull, 16ull);
+  });
+  bench_assert("oh_assert_finalize", 8, iterations, [](uint64_t *hash) {
+    oh_assert_finalize(0, hash, 8, 1ull, 2ull, 3ull, 4ull, 5ull, 6ull, 7ull,
+                       16ull);
+  });
+  bench_assert("oh_assert_finalize", 16, iterations, [](uint64_t *hash) {
+    oh_assert_finalize(0, hash, 16, 1ull, 2ull, 3ull, 4ull, 5ull, 6ull, 7ull,
+                       8ull, 9ull, 10ull, 11ull, 12ull, 13ull, 14ull, 15ull,
+                       16ull);
+  });
+}
+
+// oh_log keeps the distinct hashes per site, measure a site seeing a single
+// value and sites cycling through a few values
+void bench_logger(uint64_t iterations) {
+  const unsigned distinct_counts[] = {1, 8};
+  for (unsigned distinct : distinct_counts) {
+    uint64_t hash = 0;
+    stopwatch watch;
+    for (uint64_t i = 0; i < iterations; ++i) {
+      hash = i % distinct;
+      oh_log(1 + (i & 63), &hash);
+    }
+    report("logger", "oh_log", std::to_string(distinct), "ns_per_event",
+           watch.ns_per(iterations));
+  }
+}
+
+// mean fraction of output bits flipped by flipping a single input bit
+// (ideal 0.5) and the worst (input bit, output bit) flip probability bias
+void avalanche(const kernel_info &kernel) {
+  const unsigned samples = 2000;
+  std::mt19937_64 gen(42);
+  std::vector<unsigned> flips(64 * 64, 0);
+  uint64_t total_flipped = 0;
+  for (unsigned s = 0; s < samples; ++s) {
+    const uint64_t state = gen();
+    const uint64_t value = gen();
+    uint64_t reference = state;
+    kernel.kernel(&reference, value, s);
+    for (unsigned in_bit = 0; in_bit < 64; ++in_bit) {
+      uint64_t flipped = state;
+      kernel.kernel(&flipped, value ^ (1ull << in_bit), s);
+      const uint64_t diff = reference ^ flipped;
+      total_flipped += __builtin_popcountll(diff);
+      for (unsigned out_bit = 0; out_bit < 64; ++out_bit) {
+        flips[in_bit * 64 + out_bit] += (diff >> out_bit) & 1;
+      }
+    }
+  }
+  double worst_bias = 0;
+  for (unsigned count : flips) {
+    worst_bias =
+        std::max(worst_bias, std::abs(double(count) / samples - 0.5));
+  }
+  report("quality", kernel.name, "avalanche", "mean_flip_fraction",
+         double(total_flipped) / (samples * 64.0 * 64.0));
+  report("quality", kernel.name, "avalanche", "worst_bias", worst_bias);
+}
+
+// number of distinct value sequences of one synthetic stream ending in an
+// already seen hash state
+uint64_t count_collisions(const kernel_info &kernel,
+                          const std::vector<std::vector<uint64_t>> &streams) {
+  std::vector<uint64_t> finals;
+  finals.reserve(streams.size());
+  for (const auto &stream : streams) {
+    uint64_t hash = 0;
+    for (unsigned site = 0; site < stream.size(); ++site) {
+      kernel.kernel(&hash, stream[site], site);
+    }
+    finals.push_back(hash);
+  }
+  std::sort(finals.begin(), finals.end());
+  return finals.size() -
+         (std::unique(finals.begin(), finals.end()) - finals.begin());
+}
+
+void collisions(const kernel_info &kernel) {
+  const unsigned stream_count = 1 << 16;
+  const unsigned length = 8;
+  std::mt19937_64 gen(7);
+  std::vector<std::vector<uint64_t>> sequential, small, sparse, permuted;
+  std::vector<uint64_t> base(length);
+  for (auto &value : base) {
+    value = gen() & 0xffff;
+  }
+  for (unsigned i = 0; i < stream_count; ++i) {
+    std::vector<uint64_t> seq(length), sm(length), sp(length);
+    for (unsigned j = 0; j < length; ++j) {
+      seq[j] = i + j;
+      sm[j] = (i >> (2 * j)) & 3;
+      sp[j] = 1ull << (gen() % 64);
+    }
+    sequential.push_back(seq);
+    small.push_back(sm);
+    sparse.push_back(sp);
+  }
+  // all orderings of the same values, detects order insensitive kernels
+  std::sort(base.begin(), base.end());
+  unsigned permutations = 0;
+  do {
+    permuted.push_back(base);
+  } while (std::next_permutation(base.begin(), base.end()) &&
+           ++permutations < stream_count);
+
+  report("quality", kernel.name, "sequential", "collisions",
+         count_collisions(kernel, sequential));
+  report("quality", kernel.name, "small", "collisions",
+         count_collisions(kernel, small));
+  report("quality", kernel.name, "sparse", "collisions",
+         count_collisions(kernel, sparse));
+  report("quality", kernel.name, "permuted", "collisions",
+         count_collisions(kernel, permuted));
+}
+}
+
+int main(int argc, char *argv[]) {
+  const uint64_t iterations =
+      argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+  bench_kernels(iterations);
+  bench_asserts(iterations);
+  bench_logger(iterations);
+  for (const auto &kernel : kernels) {
+    avalanche(kernel);
+    collisions(kernel);
+  }
+  return 0;
+}
@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+"""End-to-end overhead benchmark for oblivious hashing.
+
+Builds every workload listed in workloads/workloads.txt in three variants,
+following the same steps as run-oh.sh:
+
+  baseline   the unmodified program
+  training   instrumented with -oh-insert and linked with the logging runtime
+  protected  the result of -insert-asserts and -insert-asserts-finalize
+
+Each variant is run --repetitions times. Median wall time, instructions
+retired (when `perf` is available), max RSS and .text size are written as
+JSON, together with the deltas of training and protected against baseline.
+"""
+
+import argparse
+import json
+import os
+import platform
+import shutil
+import statistics
+import subprocess
+import sys
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--plugin', required=True,
+                        help='path to liboblivious-hashing.so')
+    parser.add_argument('--input-dep-lib', default='/usr/local/lib/libInputDependency.so')
+    parser.add_argument('--clang', default='clang-3.9')
+    parser.add_argument('--clangxx', default='clang++-3.9')
+    parser.add_argument('--opt', default='opt-3.9')
+    parser.add_argument('--llvm-link', default='llvm-link-3.9')
+    parser.add_argument('--cflags', default='-O2',
+                        help='flags used to compile every variant')
+    parser.add_argument('--num-hash', default='1')
+    parser.add_argument('--insert-args', default='',
+                        help='extra arguments for -oh-insert')
+    parser.add_argument('--finalize-args', default='',
+                        help='extra arguments for -insert-asserts-finalize')
+    parser.add_argument('--repetitions', type=int, default=5)
+    parser.add_argument('--workloads', default='',
+                        help='comma separated subset of workloads to run')
+    parser.add_argument('--work-dir', default=os.path.join(os.getcwd(), 'oh-bench'))
+    parser.add_argument('--out', default='-', help='result file, - for stdout')
+    return parser.parse_args()
+
+
+def read_workloads(selected):
+    workloads = []
+    with open(os.path.join(BENCH_DIR, 'workloads', 'workloads.txt')) as manifest:
+        for line in manifest:
+            line = line.split('#', 1)[0].split()
+            if not line:
+                continue
+            name, source, run_args = line[0], line[1], line[2:]
+            if selected and name not in selected:
+                continue
+            workloads.append({'name': name,
+                              'source': os.path.join(BENCH_DIR, 'workloads', source),
+                              'args': run_args})
+    return workloads
+
+
+class Builder:
+    def __init__(self, args, work_dir):
+        self.args = args
+        self.work_dir = work_dir
+
+    def run(self, cmd):
+        subprocess.check_call(cmd, cwd=self.work_dir, stdout=subprocess.DEVNULL)
+
+    def opt(self, pass_args, extra, src, dst):
+        self.run([self.args.opt, '-load', self.args.input_dep_lib,
+                  '-load', self.args.plugin, src] + pass_args + extra.split() + ['-o', dst])
+
+    def compiler(self, source):
+        return self.args.clangxx if source.endswith('.cpp') else self.args.clang
+
+    def runtime_bitcode(self):
+        runtime = {}
+        for name, source in (('hash', 'hashes/hash.c'),
+                             ('asserts', 'assertions/asserts.cpp'),
+                             ('logs', 'assertions/logs.cpp')):
+            source = os.path.join(REPO_DIR, source)
+            dst = name + '.bc'
+            std = ['-std=c++0x'] if source.endswith('.cpp') else []
+            self.run([self.compiler(source)] + self.args.cflags.split() + std +
+                     ['-fno-use-cxa-atexit', '-c', '-emit-llvm', source, '-o', dst])
+            runtime[name] = dst
+        return runtime
+
+    def link_binary(self, bitcode, binary):
+        self.run([self.args.clangxx] + self.args.cflags.split() +
+                 ['-pthread', '-rdynamic', bitcode, '-o', binary, '-lm', '-lrt'])
+
+    def build(self, workload, runtime):
+        """Builds the three variants, running the intermediate binaries on the
+        workload input to collect training data."""
+        source = workload['source']
+        self.run([self.compiler(source)] + self.args.cflags.split() +
+                 ['-c', '-emit-llvm', source, '-o', 'program.bc'])
+        self.link_binary('program.bc', 'baseline')
+
+        self.opt(['-oh-insert', '-num-hash', self.args.num_hash, '-skip', 'hash'],
+                 self.args.insert_args, 'program.bc', 'out.bc')
+        self.run([self.args.llvm_link, 'out.bc', runtime['hash'], runtime['asserts'],
+                  runtime['logs'], '-o', 'out.bc'])
+        self.link_binary('out.bc', 'training')
+        self.run(['./training'] + workload['args'])
+
+        if os.path.exists(os.path.join(self.work_dir, 'hashes_dumper.log')):
+            os.remove(os.path.join(self.work_dir, 'hashes_dumper.log'))
+        self.opt(['-insert-asserts'], '', 'out.bc', 'protected.bc')
+        self.link_binary('protected.bc', 'dumper')
+        self.run(['./dumper'] + workload['args'])
+        self.opt(['-insert-asserts-finalize'], self.args.finalize_args,
+                 'protected.bc', 'protected.bc')
+        self.link_binary('protected.bc', 'protected')
+
+
+def text_size(binary):
+    output = subprocess.check_output(['size', '-A', binary], universal_newlines=True)
+    for line in output.splitlines():
+        fields = line.split()
+        if fields and fields[0] == '.text':
+            return int(fields[1])
+    return None
+
+
+def perf_available():
+    if shutil.which('perf') is None:
+        return False
+    return subprocess.call(['perf', 'stat', '-x,', '-e', 'instructions', 'true'],
+                           stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL) == 0
+
+
+def run_once(cmd, cwd, use_perf):
+    """Returns wall time, max RSS in KiB and instructions retired (or None)."""
+    perf_out = os.path.join(cwd, 'perf.csv')
+    if use_perf:
+        cmd = ['perf', 'stat', '-x,', '-e', 'instructions:u', '-o', perf_out] + cmd
+    start = time.perf_counter()
+    process = subprocess.Popen(cmd, cwd=cwd, stdout=subprocess.DEVNULL)
+    _, status, usage = os.wait4(process.pid, 0)
+    wall = time.perf_counter() - start
+    if os.WIFSIGNALED(status) or os.WEXITSTATUS(status) != 0:
+        raise RuntimeError('%s failed with status %d' % (' '.join(cmd), status))
+    instructions = None
+    if use_perf:
+        with open(perf_out) as csv:
+            for line in csv:
+                fields = line.split(',')
+                if len(fields) > 2 and fields[2].startswith('instructions'):
+                    instructions = int(fields[0]) if fields[0].isdigit() else None
+    return wall, usage.ru_maxrss, instructions
+
+
+def measure(binary, workload, work_dir, repetitions, use_perf):
+    walls, rss, instructions = [], [], []
+    for _ in range(repetitions):
+        wall, max_rss, instr = run_once(['./' + binary] + workload['args'], work_dir, use_perf)
+        walls.append(wall)
+        rss.append(max_rss)
+        if instr is not None:
+            instructions.append(instr)
+    return {
+        'wall_seconds': statistics.median(walls),
+        'wall_seconds_min': min(walls),
+        'wall_seconds_max': max(walls),
+        'instructions': int(statistics.median(instructions)) if instructions else None,
+        'max_rss_kib': max(rss),
+        'text_bytes': text_size(os.path.join(work_dir, binary)),
+    }
+
+
+def relative(value, base):
+    if value is None or not base:
+        return None
+    return (value - base) / base
+
+
+def main():
+    args = parse_args()
+    selected = set(filter(None, args.workloads.split(',')))
+    use_perf = perf_available()
+    results = {
+        'host': platform.node(),
+        'machine': platform.machine(),
+        'timestamp': int(time.time()),
+        'revision': subprocess.check_output(['git', 'rev-parse', 'HEAD'], cwd=REPO_DIR,
+                                            universal_newlines=True).strip(),
+        'config': {'cflags': args.cflags, 'num_hash': args.num_hash,
+                   'insert_args': args.insert_args,
+                   'finalize_args': args.finalize_args,
+                   'repetitions': args.repetitions},
+        'workloads': [],
+    }
+    for workload in read_workloads(selected):
+        work_dir = os.path.join(args.work_dir, workload['name'])
+        os.makedirs(work_dir, exist_ok=True)
+        builder = Builder(args, work_dir)
+        print('building %s' % workload['name'], file=sys.stderr)
+        builder.build(workload, builder.runtime_bitcode())
+        variants = {}
+        for variant in ('baseline', 'training', 'protected'):
+            print('running %s/%s' % (workload['name'], variant), file=sys.stderr)
+            variants[variant] = measure(variant, workload, work_dir,
+                                        args.repetitions, use_perf)
+        base = variants['baseline']
+        deltas = {}
+        for variant in ('training', 'protected'):
+            deltas[variant] = {metric: relative(variants[variant][metric], base[metric])
+                               for metric in ('wall_seconds', 'instructions',
+                                              'max_rss_kib', 'text_bytes')}
+        results['workloads'].append({'name': workload['name'], 'args': workload['args'],
+                                     'variants': variants, 'deltas': deltas})
+
+    output = json.dumps(results, indent=2, sort_keys=True)
+    if args.out == '-':
+        print(output)
+    else:
+        with open(args.out, 'w') as out:
+            out.write(output + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""Compile time scaling benchmark for the oblivious hashing passes.
+
+Generates synthetic modules of growing size with oh-gen-module and runs the
+pipeline of run-oh.sh on each of them, measuring wall time and peak memory of
+the -oh-insert, -insert-asserts and -insert-asserts-finalize opt invocations.
+For every pass the log-log slope between consecutive sizes is reported as
+well; a slope clearly above 1 means the pass scales superlinearly with the
+number of functions.
+"""
+
+import argparse
+import json
+import math
+import os
+import subprocess
+import sys
+import time
+
+from run_benchmarks import Builder, REPO_DIR
+
+PASSES = ('oh-insert', 'insert-asserts', 'insert-asserts-finalize')
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--generator', required=True, help='path to oh-gen-module')
+    parser.add_argument('--plugin', required=True,
+                        help='path to liboblivious-hashing.so')
+    parser.add_argument('--input-dep-lib', default='/usr/local/lib/libInputDependency.so')
+    parser.add_argument('--clang', default='clang-3.9')
+    parser.add_argument('--clangxx', default='clang++-3.9')
+    parser.add_argument('--opt', default='opt-3.9')
+    parser.add_argument('--llvm-link', default='llvm-link-3.9')
+    parser.add_argument('--cflags', default='-O0')
+    parser.add_argument('--num-hash', default='1')
+    parser.add_argument('--functions', default='100,200,400,800,1600',
+                        help='comma separated function counts of the sweep')
+    parser.add_argument('--blocks', default='10')
+    parser.add_argument('--loop-depth', default='1')
+    parser.add_argument('--call-density', default='0.2')
+    parser.add_argument('--indirect-calls', default='0.1')
+    parser.add_argument('--work-dir', default=os.path.join(os.getcwd(), 'oh-compile-bench'))
+    parser.add_argument('--out', default='-', help='result file, - for stdout')
+    return parser.parse_args()
+
+
+def timed(cmd, cwd):
+    """Runs cmd, returns wall time and peak RSS in KiB."""
+    start = time.perf_counter()
+    process = subprocess.Popen(cmd, cwd=cwd, stdout=subprocess.DEVNULL,
+                               stderr=subprocess.DEVNULL)
+    _, status, usage = os.wait4(process.pid, 0)
+    wall = time.perf_counter() - start
+    if os.WIFSIGNALED(status) or os.WEXITSTATUS(status) != 0:
+        raise RuntimeError('%s failed with status %d' % (' '.join(cmd), status))
+    return {'wall_seconds': wall, 'max_rss_kib': usage.ru_maxrss}
+
+
+def opt_cmd(args, pass_args, src, dst):
+    return [args.opt, '-load', args.input_dep_lib, '-load', args.plugin, src] + \
+        pass_args + ['-o', dst]
+
+
+def measure_size(args, builder, runtime, functions):
+    work_dir = builder.work_dir
+    builder.run([args.generator, '-functions', str(functions), '-blocks', args.blocks,
+                 '-loop-depth', args.loop_depth, '-call-density', args.call_density,
+                 '-indirect-calls', args.indirect_calls, '-o', 'program.bc'])
+    result = {'functions': functions,
+              'bitcode_bytes': os.path.getsize(os.path.join(work_dir, 'program.bc'))}
+
+    result['oh-insert'] = timed(opt_cmd(args, ['-oh-insert', '-num-hash', args.num_hash,
+                                               '-skip', 'hash'],
+                                        'program.bc', 'out.bc'), work_dir)
+    builder.run([args.llvm_link, 'out.bc', runtime['hash'], runtime['asserts'],
+                 runtime['logs'], '-o', 'out.bc'])
+    builder.link_binary('out.bc', 'training')
+    builder.run(['./training'])
+
+    if os.path.exists(os.path.join(work_dir, 'hashes_dumper.log')):
+        os.remove(os.path.join(work_dir, 'hashes_dumper.log'))
+    result['insert-asserts'] = timed(opt_cmd(args, ['-insert-asserts'],
+                                             'out.bc', 'protected.bc'), work_dir)
+    builder.link_binary('protected.bc', 'dumper')
+    builder.run(['./dumper'])
+    result['insert-asserts-finalize'] = timed(opt_cmd(args, ['-insert-asserts-finalize'],
+                                                      'protected.bc', 'final.bc'),
+                                              work_dir)
+    return result
+
+
+def scaling(sizes):
+    """log-log slopes of wall time between consecutive sweep points"""
+    slopes = {}
+    for name in PASSES:
+        slopes[name] = []
+        for smaller, larger in zip(sizes, sizes[1:]):
+            t0 = smaller[name]['wall_seconds']
+            t1 = larger[name]['wall_seconds']
+            if t0 <= 0 or t1 <= 0:
+                slopes[name].append(None)
+                continue
+            slopes[name].append(math.log(t1 / t0) /
+                                math.log(larger['functions'] / smaller['functions']))
+    return slopes
+
+
+def main():
+    args = parse_args()
+    os.makedirs(args.work_dir, exist_ok=True)
+    builder = Builder(args, args.work_dir)
+    runtime = builder.runtime_bitcode()
+    sizes = []
+    for functions in sorted(int(f) for f in args.functions.split(',')):
+        print('measuring %d functions' % functions, file=sys.stderr)
+        sizes.append(measure_size(args, builder, runtime, functions))
+    results = {
+        'revision': subprocess.check_output(['git', 'rev-parse', 'HEAD'], cwd=REPO_DIR,
+                                            universal_newlines=True).strip(),
+        'config': {'blocks': args.blocks, 'loop_depth': args.loop_depth,
+                   'call_density': args.call_density,
+                   'indirect_calls': args.indirect_calls, 'num_hash': args.num_hash},
+        'sizes': sizes,
+        'scaling': scaling(sizes),
+    }
+    output = json.dumps(results, indent=2, sort_keys=True)
+    if args.out == '-':
+        print(output)
+    else:
+        with open(args.out, 'w') as out:
+            out.write(output + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+static int fib(int n)
+{
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+static long op_add(long a, long b) { return a + b; }
+static long op_sub(long a, long b) { return a - b; }
+static long op_xor(long a, long b) { return a ^ b; }
+static long op_mul(long a, long b) { return (a * b) & 0xffff; }
+
+typedef long (*op_func)(long, long);
+
+static long dispatch(int n)
+{
+    op_func ops[] = {op_add, op_sub, op_xor, op_mul};
+    long acc = 1;
+    for (int i = 0; i < n; ++i)
+        acc = ops[i & 3](acc, i);
+    return acc;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 30;
+    printf("calls %d %ld\n", fib(n), dispatch(n * 1000000));
+    return 0;
+}
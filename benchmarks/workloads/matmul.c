@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+static void matmul(int n, const double *a, const double *b, double *c)
+{
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j)
+            c[i * n + j] = 0;
+        for (int k = 0; k < n; ++k) {
+            double aik = a[i * n + k];
+            for (int j = 0; j < n; ++j)
+                c[i * n + j] += aik * b[k * n + j];
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 256;
+    double *a = malloc(sizeof(double) * n * n);
+    double *b = malloc(sizeof(double) * n * n);
+    double *c = malloc(sizeof(double) * n * n);
+    for (int i = 0; i < n * n; ++i) {
+        a[i] = (i % 17) * 0.25;
+        b[i] = (i % 13) * 0.5;
+    }
+    matmul(n, a, b, c);
+    double trace = 0;
+    for (int i = 0; i < n; ++i)
+        trace += c[i * n + i];
+    printf("matmul %.3f\n", trace);
+    free(a);
+    free(b);
+    free(c);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+static int sieve(int n, char *composite)
+{
+    int primes = 0;
+    for (int i = 2; i <= n; ++i) {
+        if (composite[i])
+            continue;
+        ++primes;
+        for (long j = (long)i * i; j <= n; j += i)
+            composite[j] = 1;
+    }
+    return primes;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 20000000;
+    char *composite = calloc(n + 1, 1);
+    printf("sieve %d\n", sieve(n, composite));
+    free(composite);
+    return 0;
+}
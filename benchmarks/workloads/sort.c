@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned lcg_state = 12345;
+
+static unsigned lcg_next(void)
+{
+    lcg_state = lcg_state * 1103515245u + 12345u;
+    return lcg_state >> 8;
+}
+
+static void insertion_sort(int *a, int lo, int hi)
+{
+    for (int i = lo + 1; i <= hi; ++i) {
+        int v = a[i];
+        int j = i - 1;
+        while (j >= lo && a[j] > v) {
+            a[j + 1] = a[j];
+            --j;
+        }
+        a[j + 1] = v;
+    }
+}
+
+static void quick_sort(int *a, int lo, int hi)
+{
+    while (hi - lo > 16) {
+        int pivot = a[lo + (hi - lo) / 2];
+        int i = lo;
+        int j = hi;
+        while (i <= j) {
+            while (a[i] < pivot)
+                ++i;
+            while (a[j] > pivot)
+                --j;
+            if (i <= j) {
+                int tmp = a[i];
+                a[i] = a[j];
+                a[j] = tmp;
+                ++i;
+                --j;
+            }
+        }
+        quick_sort(a, lo, j);
+        lo = i;
+    }
+    insertion_sort(a, lo, hi);
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    int *a = malloc(sizeof(int) * n);
+    for (int i = 0; i < n; ++i)
+        a[i] = (int)(lcg_next() % 1000000);
+    quick_sort(a, 0, n - 1);
+    long checksum = 0;
+    for (int i = 0; i < n; i += 97)
+        checksum += a[i];
+    printf("sort %ld\n", checksum);
+    free(a);
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TABLE_SIZE 4096
+
+static const char *dictionary[] = {
+    "oblivious", "hashing", "integrity", "protection", "tamper", "assert",
+    "runtime",   "bitcode", "module",    "function",   "block",  "loop"};
+
+struct entry {
+    char word[16];
+    unsigned count;
+};
+
+static unsigned fnv1a(const char *s)
+{
+    unsigned h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void count_word(struct entry *table, const char *word)
+{
+    unsigned pos = fnv1a(word) & (TABLE_SIZE - 1);
+    while (table[pos].count != 0 && strcmp(table[pos].word, word) != 0)
+        pos = (pos + 1) & (TABLE_SIZE - 1);
+    if (table[pos].count == 0)
+        strncpy(table[pos].word, word, sizeof(table[pos].word) - 1);
+    ++table[pos].count;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 2000000;
+    const int words = sizeof(dictionary) / sizeof(dictionary[0]);
+    struct entry *table = calloc(TABLE_SIZE, sizeof(struct entry));
+    char word[16];
+    for (int i = 0; i < n; ++i) {
+        snprintf(word, sizeof(word), "%s%d", dictionary[(i * 7) % words],
+                 i % 31);
+        count_word(table, word);
+    }
+    unsigned distinct = 0;
+    for (int i = 0; i < TABLE_SIZE; ++i)
+        distinct += table[i].count != 0;
+    printf("words %u\n", distinct);
+    free(table);
+    return 0;
+}
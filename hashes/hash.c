@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+
+#include "hash_kernels.h"
 /*
 void hash3(long long *hashVar, char* value, int size) {
   for (int i = 0; i < size; i++)
@@ -7,31 +10,54 @@ void hash3(long long *hashVar, char* value, int size) {
 }
 */
 
-// PJW Hash
-void hash2(uint64_t *hashVar, uint64_t value) {
-  //*hashVar += value;
-  uint8_t *key = (uint8_t *)&value;
-  uint64_t high = 0;
-  for (int i = 0; i < sizeof(value); i++) {
-    *hashVar = (*hashVar << 4) + key[i];
-    if ((high = *hashVar & 0xF000000000000000))
-      *hashVar ^= high >> 56;
-    *hashVar &= ~high;
+// the entry points printed every hashed value unconditionally before,
+// -DOH_HASH_TRACE restores it, with the entry point name as prefix
+#ifdef OH_HASH_TRACE
+#define OH_TRACE(name, value) printf(#name ":%lu\n", (uint64_t)(value))
+#else
+#define OH_TRACE(name, value)
+#endif
+
+/* Width specialized entry points, the pass picks one by the type of the
+ * hashed value. Integers hash only their own bytes, floating point values
+ * hash their bit pattern. */
+#define OH_DEFINE_INT_HASH(name, kernel, type)                                 \
+  void name(uint64_t *hashVar, type value) {                                   \
+    *hashVar = kernel(*hashVar, value, sizeof(value));                         \
+    OH_TRACE(name, value);                                                     \
   }
-  printf("hash2:%lu\n",value);
-  //printf("H2: %lu\n", *hashVar);
-}
 
-//CRC Variant
-void hash1(uint64_t *hashVar, uint64_t value) {
-  uint8_t *key= (uint8_t *)&value;
-  uint64_t highorder = 0;
-  for (int i = 0; i < sizeof(value); i++) {
-    highorder = *hashVar & 0xF800000000000000;
-    *hashVar = *hashVar << 5;
-    *hashVar ^= highorder >> 59;
-    *hashVar ^= key[i];
+#define OH_DEFINE_FP_HASH(name, kernel, type, bits_type)                       \
+  void name(uint64_t *hashVar, type value) {                                   \
+    bits_type bits;                                                            \
+    memcpy(&bits, &value, sizeof(bits));                                       \
+    *hashVar = kernel(*hashVar, bits, sizeof(bits));                           \
+    OH_TRACE(name, bits);                                                      \
   }
-  printf("hash1:%lu\n",value);
-  //printf("H1: %lu\n", *hashVar);
+
+// PJW Hash
+OH_DEFINE_INT_HASH(hash2_i8, oh_hash2_bytes, uint8_t)
+OH_DEFINE_INT_HASH(hash2_i16, oh_hash2_bytes, uint16_t)
+OH_DEFINE_INT_HASH(hash2_i32, oh_hash2_bytes, uint32_t)
+OH_DEFINE_INT_HASH(hash2_i64, oh_hash2_bytes, uint64_t)
+OH_DEFINE_FP_HASH(hash2_f32, oh_hash2_bytes, float, uint32_t)
+OH_DEFINE_FP_HASH(hash2_f64, oh_hash2_bytes, double, uint64_t)
+
+//CRC Variant
+OH_DEFINE_INT_HASH(hash1_i8, oh_hash1_bytes, uint8_t)
+OH_DEFINE_INT_HASH(hash1_i16, oh_hash1_bytes, uint16_t)
+OH_DEFINE_INT_HASH(hash1_i32, oh_hash1_bytes, uint32_t)
+OH_DEFINE_INT_HASH(hash1_i64, oh_hash1_bytes, uint64_t)
+OH_DEFINE_FP_HASH(hash1_f32, oh_hash1_bytes, float, uint32_t)
+OH_DEFINE_FP_HASH(hash1_f64, oh_hash1_bytes, double, uint64_t)
+
+// Associative family, the pass adds the term to the hash variable inline
+uint64_t hash_assoc_term(uint64_t key, uint64_t value) {
+  return oh_hash_assoc_term(key, value);
 }
+
+// 64 bit entry points of bitcode instrumented before the width specialized
+// ones existed
+void hash2(uint64_t *hashVar, uint64_t value) { hash2_i64(hashVar, value); }
+
+void hash1(uint64_t *hashVar, uint64_t value) { hash1_i64(hashVar, value); }
@@ -0,0 +1,71 @@
+#pragma once
+
+/* Byte wise steps of the oblivious hash functions. Shared by the runtime
+ * (hash.c) and by the passes, which need to compute the same values. */
+
+#include <stdint.h>
+
+/* CRC variant */
+static inline uint64_t oh_hash1_step(uint64_t hash, uint8_t byte) {
+  uint64_t highorder = hash & 0xF800000000000000;
+  hash = hash << 5;
+  hash ^= highorder >> 59;
+  hash ^= byte;
+  return hash;
+}
+
+/* PJW hash */
+static inline uint64_t oh_hash2_step(uint64_t hash, uint8_t byte) {
+  uint64_t high = 0;
+  hash = (hash << 4) + byte;
+  if ((high = hash & 0xF000000000000000))
+    hash ^= high >> 56;
+  hash &= ~high;
+  return hash;
+}
+
+/* hashes the low `bytes` bytes of value, least significant first, which is
+ * the memory order the original 64 bit kernels used on x86 */
+static inline uint64_t oh_hash1_bytes(uint64_t hash, uint64_t value,
+                                      unsigned bytes) {
+  for (unsigned i = 0; i < bytes; i++)
+    hash = oh_hash1_step(hash, (uint8_t)(value >> (8 * i)));
+  return hash;
+}
+
+static inline uint64_t oh_hash2_bytes(uint64_t hash, uint64_t value,
+                                      unsigned bytes) {
+  for (unsigned i = 0; i < bytes; i++)
+    hash = oh_hash2_step(hash, (uint8_t)(value >> (8 * i)));
+  return hash;
+}
+
+/* Associative family (-oh-hash-family=assoc): every update adds a term over
+ * the Mersenne prime field 2^61 - 1, with a random non zero key k per site,
+ * to the hash variable with a wrapping add. The sum does not depend on the
+ * order of the updates. The value is split into limbs below the prime,
+ * lo = its low 60 bits and hi = its top 4 bits, and the term is
+ * k * (lo + 1) + k^2 * (hi + 1): distinct values collide, and a value adds
+ * 0, only for values depending on the key, not for fixed ones such as v and
+ * v + 2^61 - 1. */
+#define OH_ASSOC_PRIME 0x1FFFFFFFFFFFFFFFULL
+#define OH_ASSOC_LO_MASK 0x0FFFFFFFFFFFFFFFULL
+
+/* x mod 2^61 - 1 */
+static inline uint64_t oh_assoc_reduce(uint64_t x) {
+  x = (x & OH_ASSOC_PRIME) + (x >> 61);
+  return x >= OH_ASSOC_PRIME ? x - OH_ASSOC_PRIME : x;
+}
+
+/* x * y mod 2^61 - 1, for x, y below 2^61 */
+static inline uint64_t oh_assoc_mul(uint64_t x, uint64_t y) {
+  unsigned __int128 product = (unsigned __int128)x * y;
+  return oh_assoc_reduce(((uint64_t)product & OH_ASSOC_PRIME) +
+                         (uint64_t)(product >> 61));
+}
+
+static inline uint64_t oh_hash_assoc_term(uint64_t key, uint64_t value) {
+  const uint64_t lo = (value & OH_ASSOC_LO_MASK) + 1;
+  const uint64_t hi = (value >> 60) + 1;
+  return oh_assoc_mul(key, oh_assoc_reduce(lo + oh_assoc_mul(key, hi)));
+}
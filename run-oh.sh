@@ -20,14 +20,23 @@ clang++-3.9 $OH_PATH/assertions/asserts.cpp -fno-use-cxa-atexit -std=c++0x -c -e
 clang-3.9 $OH_PATH/hashes/hash.c -c -fno-use-cxa-atexit -emit-llvm -o $OH_PATH/hashes/hash.bc
 clang++-3.9 $OH_PATH/assertions/logs.cpp -fno-use-cxa-atexit -std=c++0x -c -emit-llvm -o $OH_PATH/assertions/logs.bc
 
+# OH_OPT_LEVEL=N runs the -ON pipeline with the hashes inserted after the
+# optimizations, the later steps do not optimize again
+if [ -n "$OH_OPT_LEVEL" ]
+  then
+    insert_args="-O$OH_OPT_LEVEL -oh-insertion-point=late"
+else
+    insert_args="-oh-insert"
+fi
+
 # Running hash insertion pass
 if [ $# -eq 2 ] 
   then
     echo "Assert file list is supplied"
-    opt-3.9 -load $INPUT_DEP_PATH/libInputDependency.so -load  $OH_LIB/liboblivious-hashing.so $bitcode -oh-insert -num-hash 1 -skip 'hash' -assert-functions $assert_list -o out.bc
+    opt-3.9 -load $INPUT_DEP_PATH/libInputDependency.so -load  $OH_LIB/liboblivious-hashing.so $bitcode $insert_args -num-hash 1 -skip 'hash' -assert-functions $assert_list -o out.bc
 else
     echo "No assert file is supplied.."
-    opt-3.9 -load $INPUT_DEP_PATH/libInputDependency.so -load  $OH_LIB/liboblivious-hashing.so $bitcode -oh-insert -num-hash 1 -skip 'hash' -o out.bc
+    opt-3.9 -load $INPUT_DEP_PATH/libInputDependency.so -load  $OH_LIB/liboblivious-hashing.so $bitcode $insert_args -num-hash 1 -skip 'hash' -o out.bc
 fi
 # Linking with external libraries
 llvm-link-3.9 out.bc $OH_PATH/hashes/hash.bc -o out.bc
@@ -35,7 +44,7 @@ llvm-link-3.9 out.bc $OH_PATH/assertions/asserts.bc -o out.bc
 llvm-link-3.9 out.bc $OH_PATH/assertions/logs.bc -o out.bc
 
 # intermediate precompute hashes
-clang++-3.9 -lncurses -rdynamic -std=c++0x out.bc -o out
+clang++-3.9 -lncurses -rdynamic -std=c++0x out.bc -o out -lrt
 ./out $input
 ###rm out
 #
@@ -45,14 +54,14 @@ rm hashes_dumper.log
 opt-3.9 -load $INPUT_DEP_PATH/libInputDependency.so -load $OH_LIB/liboblivious-hashing.so out.bc -insert-asserts -o protected.bc
 
 # final hash computation
-clang++-3.9 -lncurses -rdynamic -std=c++0x protected.bc -o protected
+clang++-3.9 -lncurses -pthread -rdynamic -std=c++0x protected.bc -o protected -lrt
 ./protected $input
 
 
 #Runnig assertion finalization pass
 opt-3.9 -load $INPUT_DEP_PATH/libInputDependency.so -load $OH_LIB/liboblivious-hashing.so protected.bc -insert-asserts-finalize -o protected.bc
 # Compiling to final protected binary
-clang++-3.9 -lncurses -rdynamic -std=c++0x protected.bc -o protected
+clang++-3.9 -lncurses -pthread -rdynamic -std=c++0x protected.bc -o protected -lrt
 ./protected $input
 
 
@@ -1,7 +1,9 @@
 #include "AssertionFinalizePass.h"
 #include "ObliviousHashInsertion.h"
+#include "TrainingHashes.h"
 
 #include "Utils.h"
+#include "expected_table.h"
 
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
@@ -12,19 +14,119 @@
 
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <fstream>
 #include <list>
+#include <map>
 
 namespace oh {
 
+namespace {
+
+enum class AssertMode { Call, Inline, Async, Table };
+
+enum class ExpectedStorage { Section, File };
+
+// a countdown shared by the threads is accessed with relaxed atomics, lost
+// decrements only shift the next check
+template <typename Access>
+void set_countdown_access(Access *access, bool shared) {
+  if (shared) {
+    access->setAtomic(llvm::AtomicOrdering::Monotonic);
+    access->setAlignment(4);
+  }
+}
+
+unsigned get_site_id(llvm::CallInst *log_call) {
+  auto *id = llvm::dyn_cast<llvm::ConstantInt>(log_call->getArgOperand(0));
+  assert(id != nullptr);
+  return id->getZExtValue();
+}
+}
+
 char AssertionFinalizePass::ID = 0;
 
+static llvm::cl::opt<AssertMode> assert_mode(
+    "oh-assert-mode",
+    llvm::cl::desc("Specify how finalized assertions are emitted"),
+    llvm::cl::values(
+        clEnumValN(AssertMode::Call, "call",
+                   "call oh_assert_finalize with the expected hashes"),
+        clEnumValN(AssertMode::Inline, "inline",
+                   "compare inline, call the runtime only on failure"),
+        clEnumValN(AssertMode::Async, "async",
+                   "queue the hash for a background verifier thread"),
+        clEnumValN(AssertMode::Table, "table",
+                   "call oh_assert_table, the expected hashes are in a table "
+                   "outside the code (see -oh-expected-storage)"),
+        clEnumValEnd),
+    llvm::cl::init(AssertMode::Call));
+
+static llvm::cl::opt<ExpectedStorage> expected_storage(
+    "oh-expected-storage",
+    llvm::cl::desc("Where -oh-assert-mode=table puts the expected hashes"),
+    llvm::cl::values(
+        clEnumValN(ExpectedStorage::Section, "section",
+                   "the oh_expected section of the program"),
+        clEnumValN(ExpectedStorage::File, "file",
+                   "the file given by -oh-expected-file, mapped by the "
+                   "runtime on the first check"),
+        clEnumValEnd),
+    llvm::cl::init(ExpectedStorage::Section));
+
+static llvm::cl::opt<std::string> expected_file(
+    "oh-expected-file",
+    llvm::cl::desc("Sidecar file of -oh-expected-storage=file"),
+    llvm::cl::value_desc("filename"), llvm::cl::init("oh_expected.bin"));
+
+static llvm::cl::opt<bool> telemetry(
+    "oh-telemetry",
+    llvm::cl::desc("Count passed inline checks in the runtime's telemetry "
+                   "(other modes and failures are always counted)"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> outline_cold(
+    "oh-outline-cold",
+    llvm::cl::desc("Compare call and inline mode sites with up to "
+                   "-oh-outline-inline-hashes expected hashes inline and "
+                   "outline the rest of the check into cold functions in "
+                   "section .text.oh_cold"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned> outline_inline_hashes(
+    "oh-outline-inline-hashes",
+    llvm::cl::desc("Expected hashes an -oh-outline-cold site compares inline, "
+                   "sites with more candidates call the cold function when "
+                   "none of these matches"),
+    llvm::cl::init(4));
+
+static llvm::cl::opt<unsigned> sample_rate(
+    "oh-sample-rate",
+    llvm::cl::desc("Check each assertion site only every Nth execution"),
+    llvm::cl::value_desc("N"), llvm::cl::init(1));
+
+static llvm::cl::opt<unsigned> sample_backoff(
+    "oh-sample-backoff",
+    llvm::cl::desc("Double the sampling interval of a site after K "
+                   "consecutive passed checks (0 disables back-off)"),
+    llvm::cl::value_desc("K"), llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned> sample_max_interval(
+    "oh-sample-max-interval",
+    llvm::cl::desc("Upper bound for the back-off sampling interval"),
+    llvm::cl::value_desc("N"), llvm::cl::init(1 << 16));
+
 bool AssertionFinalizePass::runOnModule(llvm::Module &M) {
   llvm::dbgs() << "Finalize assertions\n";
 
@@ -32,41 +134,99 @@ bool AssertionFinalizePass::runOnModule(llvm::Module &M) {
   parse_hashes();
   unique_id_generator::get().reset();
   setup_assert_function(M);
+  // inline checks split blocks, collect the calls before rewriting them
+  std::list<llvm::CallInst *> log_calls;
+  std::list<llvm::CallInst *> precomputed_calls;
   for (auto &F : M) {
     for (auto &B : F) {
       for (auto &I : B) {
         if (auto *callInst = llvm::dyn_cast<llvm::CallInst>(&I)) {
           auto calledF = callInst->getCalledFunction();
           if (calledF && calledF->getName() == "oh_assert_dumper") {
-            process_log_call(callInst);
-            modified = true;
+            log_calls.push_back(callInst);
+          } else if (calledF && calledF->getName() == "oh_input_dep_log") {
+            precomputed_calls.push_back(callInst);
           }
         }
       }
     }
   }
+  for (auto *precomputed_call : precomputed_calls) {
+    log_calls.push_back(add_precomputed_site(precomputed_call));
+  }
+  unsigned sites_count = 0;
+  bool thread_local_hashes = false;
+  for (auto *log_call : log_calls) {
+    sites_count = std::max(sites_count, get_site_id(log_call) + 1);
+    auto *hash_var = llvm::dyn_cast<llvm::GlobalVariable>(
+        log_call->getArgOperand(1)->stripPointerCasts());
+    thread_local_hashes |= hash_var != nullptr && hash_var->isThreadLocal();
+  }
+  const bool sampling = sample_rate > 1 || sample_backoff > 0;
+  if (sampling) {
+    setup_sampling(M, sites_count, thread_local_hashes);
+  }
+  if (assert_mode == AssertMode::Async) {
+    setup_async_verifier(M, sites_count);
+  }
+  if (assert_mode == AssertMode::Table &&
+      !setup_expected_table(M, sites_count)) {
+    exit(1);
+  }
+  for (auto *log_call : log_calls) {
+    if (sampling) {
+      insert_sampling_gate(log_call);
+    }
+    if (outline_cold && (assert_mode == AssertMode::Call ||
+                         assert_mode == AssertMode::Inline)) {
+      insert_outlined_check(log_call);
+    } else if (assert_mode == AssertMode::Inline) {
+      insert_inline_check(log_call);
+    } else if (assert_mode == AssertMode::Async) {
+      insert_async_check(log_call);
+    } else if (assert_mode == AssertMode::Table) {
+      insert_table_check(log_call);
+    } else {
+      process_log_call(log_call);
+    }
+    modified = true;
+  }
   return modified;
 }
 
 void AssertionFinalizePass::parse_hashes() {
-  hashes.resize(100000);
-  std::ifstream hash_strm;
-  hash_strm.open("hashes_dumper.log");
-  if(!hash_strm.good()){
-    llvm::errs()<<"ERR. hashes_dumper.log cannot be found!\n";
+  auto &training = TrainingHashes::get(TrainingHashes::Dumper);
+  // hashes collected by an in-process training run take precedence
+  if (!training.is_collected() && !training.read_log("hashes_dumper.log")) {
+    llvm::errs() << "ERR. hashes_dumper.log cannot be found!\n";
     exit(1);
   }
-  std::string id_str;
-  std::string hash_str;
-  while (!hash_strm.eof()) {
-    hash_strm >> id_str;
-    hash_strm >> hash_str;
-    unsigned id = std::stoi(id_str);
-    uint64_t hash = std::stoull(hash_str);
-    // llvm::dbgs() << id << " " << hash << "\n";
-    hashes[id].insert(hash);
+  hashes = training.get_sites();
+}
+
+// loggers precomputed by -oh-insert -oh-precompute-constants are not in the
+// training logs, they carry the expected hash and become an oh_assert_dumper
+// call like the trained sites
+llvm::CallInst *
+AssertionFinalizePass::add_precomputed_site(llvm::CallInst *input_dep_call) {
+  const unsigned log_id = get_site_id(input_dep_call);
+  auto *expected =
+      llvm::cast<llvm::ConstantInt>(input_dep_call->getArgOperand(2));
+  if (hashes.size() <= log_id) {
+    hashes.resize(log_id + 1);
   }
-  hash_strm.close();
+  hashes[log_id].insert(expected->getZExtValue());
+
+  llvm::IRBuilder<> builder(input_dep_call);
+  auto *log_call = builder.CreateCall(
+      dumper, {input_dep_call->getArgOperand(0),
+               input_dep_call->getArgOperand(1), builder.getInt32(1), expected});
+  input_dep_call->eraseFromParent();
+  return log_call;
+}
+
+bool AssertionFinalizePass::has_precomputed_hashes(unsigned log_id) const {
+  return log_id < hashes.size() && !hashes[log_id].empty();
 }
 
 void AssertionFinalizePass::setup_assert_function(llvm::Module &M) {
@@ -81,6 +241,28 @@ void AssertionFinalizePass::setup_assert_function(llvm::Module &M) {
       llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), assert_params, true);
   assert = llvm::dyn_cast<llvm::Function>(
       M.getOrInsertFunction("oh_assert_finalize", assert_type));
+  dumper = llvm::dyn_cast<llvm::Function>(
+      M.getOrInsertFunction("oh_assert_dumper", assert_type));
+
+  // reporting routine of inline checks: id and the mismatching hash variable
+  llvm::ArrayRef<llvm::Type *> failed_params{llvm::Type::getInt32Ty(Ctx),
+                                             llvm::Type::getInt64PtrTy(Ctx)};
+  llvm::FunctionType *failed_type =
+      llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), failed_params, false);
+  assert_failed = llvm::dyn_cast<llvm::Function>(
+      M.getOrInsertFunction("oh_assert_failed", failed_type));
+  assert_failed->addFnAttr(llvm::Attribute::Cold);
+  assert_failed->setDoesNotReturn();
+  assert_failed->setDoesNotThrow();
+
+  expect = llvm::Intrinsic::getDeclaration(&M, llvm::Intrinsic::expect,
+                                           {llvm::Type::getInt1Ty(Ctx)});
+
+  llvm::FunctionType *telemetry_type = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(Ctx), {llvm::Type::getInt32Ty(Ctx)}, false);
+  telemetry_check = llvm::dyn_cast<llvm::Function>(
+      M.getOrInsertFunction("oh_telemetry_check", telemetry_type));
+  telemetry_check->setDoesNotThrow();
 }
 
 void AssertionFinalizePass::process_log_call(llvm::CallInst *log_call) {
@@ -88,11 +270,11 @@ void AssertionFinalizePass::process_log_call(llvm::CallInst *log_call) {
   llvm::dbgs()<<"Processing an oh_assert_dumper call:";
   log_call->print(llvm::dbgs(),true);
   llvm::dbgs()<<"\n";
-  const unsigned log_id = unique_id_generator::get().next();
-  const auto &precomputed_hashes = hashes[log_id];
-  if (precomputed_hashes.empty()) {
+  const unsigned log_id = get_site_id(log_call);
+  if (!has_precomputed_hashes(log_id)) {
     return;
   }
+  const auto &precomputed_hashes = hashes[log_id];
   // llvm::dbgs() << "log_id " << log_id << " hash values: ";
 
   llvm::LLVMContext &Ctx = log_call->getModule()->getContext();
@@ -141,6 +323,422 @@ void AssertionFinalizePass::process_log_call(llvm::CallInst *log_call) {
   // builder.CreateCall(assert, arg_values);
 }
 
+void AssertionFinalizePass::insert_inline_check(llvm::CallInst *log_call) {
+  const unsigned log_id = get_site_id(log_call);
+  if (!has_precomputed_hashes(log_id)) {
+    return;
+  }
+  // sort to keep the emitted compare chain stable between runs
+  std::vector<uint64_t> precomputed_hashes(hashes[log_id].begin(),
+                                           hashes[log_id].end());
+  std::sort(precomputed_hashes.begin(), precomputed_hashes.end());
+
+  llvm::LLVMContext &Ctx = log_call->getModule()->getContext();
+  llvm::Value *id_val = log_call->getArgOperand(0);
+  llvm::Value *hash_val = log_call->getArgOperand(1);
+  llvm::BasicBlock *check_block = log_call->getParent();
+  llvm::Function *F = check_block->getParent();
+
+  // check_block: load hash, compare, branch
+  // pass_block: rest of the original block
+  // fail_block: at the end of the function, reports and aborts
+  llvm::BasicBlock *pass_block =
+      check_block->splitBasicBlock(log_call, "oh.assert.pass");
+  check_block->getTerminator()->eraseFromParent();
+  llvm::BasicBlock *fail_block =
+      llvm::BasicBlock::Create(Ctx, "oh.assert.fail", F);
+
+  llvm::IRBuilder<> builder(check_block);
+  llvm::Value *hash = builder.CreateLoad(hash_val);
+  llvm::Value *matches = nullptr;
+  for (const auto &hash_value : precomputed_hashes) {
+    llvm::Value *eq = builder.CreateICmpEQ(
+        hash, llvm::ConstantInt::get(llvm::Type::getInt64Ty(Ctx), hash_value));
+    matches = matches ? builder.CreateOr(matches, eq) : eq;
+  }
+  llvm::Value *expected =
+      builder.CreateCall(expect, {matches, builder.getTrue()});
+  builder.CreateCondBr(expected, pass_block, fail_block);
+
+  if (telemetry) {
+    llvm::IRBuilder<> pass_builder(pass_block->getFirstNonPHI());
+    pass_builder.CreateCall(telemetry_check, {id_val});
+  }
+
+  builder.SetInsertPoint(fail_block);
+  auto *report = builder.CreateCall(assert_failed, {id_val, hash_val});
+  report->setDoesNotReturn();
+  builder.CreateUnreachable();
+
+  log_call->eraseFromParent();
+}
+
+void AssertionFinalizePass::insert_outlined_check(llvm::CallInst *log_call) {
+  const unsigned log_id = get_site_id(log_call);
+  if (!has_precomputed_hashes(log_id)) {
+    return;
+  }
+  std::vector<uint64_t> precomputed_hashes(hashes[log_id].begin(),
+                                           hashes[log_id].end());
+  std::sort(precomputed_hashes.begin(), precomputed_hashes.end());
+  llvm::Function *cold_check =
+      get_cold_check(*log_call->getModule(), precomputed_hashes);
+
+  llvm::LLVMContext &Ctx = log_call->getModule()->getContext();
+  llvm::Value *id_val = log_call->getArgOperand(0);
+  llvm::Value *hash_val = log_call->getArgOperand(1);
+  llvm::BasicBlock *check_block = log_call->getParent();
+  llvm::Function *F = check_block->getParent();
+
+  // check_block: load hash, compare with the inline expected hashes
+  // fast_block: counts the passed check (-oh-telemetry)
+  // slow_block: at the end of the function, calls the outlined check
+  // pass_block: rest of the original block
+  llvm::BasicBlock *pass_block =
+      check_block->splitBasicBlock(log_call, "oh.assert.pass");
+  check_block->getTerminator()->eraseFromParent();
+  llvm::BasicBlock *slow_block =
+      llvm::BasicBlock::Create(Ctx, "oh.assert.slow", F);
+
+  llvm::IRBuilder<> builder(check_block);
+  llvm::Value *hash = builder.CreateLoad(hash_val);
+  // the training logs carry no frequencies, so without all candidates inline
+  // nothing tells which branch is likely
+  const unsigned inline_count = std::max(
+      1u, std::min<unsigned>(outline_inline_hashes, precomputed_hashes.size()));
+  llvm::Value *matches = nullptr;
+  for (unsigned i = 0; i < inline_count; ++i) {
+    llvm::Value *eq =
+        builder.CreateICmpEQ(hash, builder.getInt64(precomputed_hashes[i]));
+    matches = matches ? builder.CreateOr(matches, eq) : eq;
+  }
+  llvm::Value *expected = matches;
+  if (inline_count == precomputed_hashes.size()) {
+    expected = builder.CreateCall(expect, {matches, builder.getTrue()});
+  }
+  llvm::BasicBlock *fast_target = pass_block;
+  if (telemetry) {
+    fast_target = llvm::BasicBlock::Create(Ctx, "oh.assert.fast", F, pass_block);
+    llvm::IRBuilder<> fast_builder(fast_target);
+    fast_builder.CreateCall(telemetry_check, {id_val});
+    fast_builder.CreateBr(pass_block);
+  }
+  builder.CreateCondBr(expected, fast_target, slow_block);
+
+  builder.SetInsertPoint(slow_block);
+  builder.CreateCall(cold_check, {id_val, hash_val});
+  builder.CreateBr(pass_block);
+
+  log_call->eraseFromParent();
+}
+
+// void (i32 id, i64* hashVar) checking all expected hashes: a call of
+// oh_assert_finalize in call mode, the inline check otherwise
+llvm::Function *AssertionFinalizePass::get_cold_check(
+    llvm::Module &M, const std::vector<uint64_t> &expected_hashes) {
+  llvm::Function *&cold_check = cold_checks[expected_hashes];
+  if (cold_check != nullptr) {
+    return cold_check;
+  }
+  llvm::LLVMContext &Ctx = M.getContext();
+  llvm::ArrayRef<llvm::Type *> check_params{llvm::Type::getInt32Ty(Ctx),
+                                            llvm::Type::getInt64PtrTy(Ctx)};
+  llvm::FunctionType *check_type = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(Ctx), check_params, false);
+  cold_check = llvm::Function::Create(
+      check_type, llvm::GlobalValue::InternalLinkage, "oh.assert.cold", &M);
+  cold_check->setSection(".text.oh_cold");
+  cold_check->addFnAttr(llvm::Attribute::Cold);
+  cold_check->addFnAttr(llvm::Attribute::NoInline);
+  cold_check->addFnAttr(llvm::Attribute::OptimizeForSize);
+  cold_check->setDoesNotThrow();
+  auto arg = cold_check->arg_begin();
+  llvm::Value *id_val = &*arg++;
+  llvm::Value *hash_val = &*arg;
+
+  llvm::IRBuilder<> builder(llvm::BasicBlock::Create(Ctx, "entry", cold_check));
+  if (assert_mode == AssertMode::Call) {
+    std::vector<llvm::Value *> arg_values{
+        id_val, hash_val, builder.getInt32(expected_hashes.size())};
+    for (const auto &hash_value : expected_hashes) {
+      arg_values.push_back(builder.getInt64(hash_value));
+    }
+    builder.CreateCall(assert, arg_values);
+    builder.CreateRetVoid();
+    return cold_check;
+  }
+
+  llvm::BasicBlock *pass_block =
+      llvm::BasicBlock::Create(Ctx, "pass", cold_check);
+  llvm::BasicBlock *fail_block =
+      llvm::BasicBlock::Create(Ctx, "fail", cold_check);
+  llvm::Value *hash = builder.CreateLoad(hash_val);
+  llvm::Value *matches = nullptr;
+  for (const auto &hash_value : expected_hashes) {
+    llvm::Value *eq = builder.CreateICmpEQ(hash, builder.getInt64(hash_value));
+    matches = matches ? builder.CreateOr(matches, eq) : eq;
+  }
+  builder.CreateCondBr(matches, pass_block, fail_block);
+
+  builder.SetInsertPoint(pass_block);
+  if (telemetry) {
+    builder.CreateCall(telemetry_check, {id_val});
+  }
+  builder.CreateRetVoid();
+
+  builder.SetInsertPoint(fail_block);
+  auto *report = builder.CreateCall(assert_failed, {id_val, hash_val});
+  report->setDoesNotReturn();
+  builder.CreateUnreachable();
+  return cold_check;
+}
+
+void AssertionFinalizePass::insert_async_check(llvm::CallInst *log_call) {
+  const unsigned log_id = get_site_id(log_call);
+  if (!has_precomputed_hashes(log_id)) {
+    return;
+  }
+  // the site only hands the current hash to the verifier thread
+  llvm::IRBuilder<> builder(log_call);
+  llvm::Value *hash = builder.CreateLoad(log_call->getArgOperand(1));
+  builder.CreateCall(assert_async, {log_call->getArgOperand(0), hash});
+  log_call->eraseFromParent();
+}
+
+void AssertionFinalizePass::setup_async_verifier(llvm::Module &M,
+                                                 unsigned sites_count) {
+  llvm::LLVMContext &Ctx = M.getContext();
+  llvm::Type *int32_ty = llvm::Type::getInt32Ty(Ctx);
+  llvm::Type *int64_ty = llvm::Type::getInt64Ty(Ctx);
+
+  llvm::ArrayRef<llvm::Type *> async_params{int32_ty, int64_ty};
+  llvm::FunctionType *async_type = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(Ctx), async_params, false);
+  assert_async = llvm::dyn_cast<llvm::Function>(
+      M.getOrInsertFunction("oh_assert_async", async_type));
+  assert_async->setDoesNotThrow();
+
+  // expected hashes of site i are values[offsets[i], offsets[i + 1]), sorted
+  // for the verifier's binary search
+  std::vector<llvm::Constant *> offsets;
+  std::vector<llvm::Constant *> values;
+  for (unsigned id = 0; id < sites_count; ++id) {
+    offsets.push_back(llvm::ConstantInt::get(int32_ty, values.size()));
+    if (!has_precomputed_hashes(id)) {
+      continue;
+    }
+    std::vector<uint64_t> site_hashes(hashes[id].begin(), hashes[id].end());
+    std::sort(site_hashes.begin(), site_hashes.end());
+    for (const auto &hash_value : site_hashes) {
+      values.push_back(llvm::ConstantInt::get(int64_ty, hash_value));
+    }
+  }
+  offsets.push_back(llvm::ConstantInt::get(int32_ty, values.size()));
+
+  auto *offsets_type = llvm::ArrayType::get(int32_ty, offsets.size());
+  auto *offsets_table = new llvm::GlobalVariable(
+      M, offsets_type, true, llvm::GlobalValue::InternalLinkage,
+      llvm::ConstantArray::get(offsets_type, offsets), "oh.expected.offsets");
+  auto *values_type = llvm::ArrayType::get(int64_ty, values.size());
+  auto *values_table = new llvm::GlobalVariable(
+      M, values_type, true, llvm::GlobalValue::InternalLinkage,
+      llvm::ConstantArray::get(values_type, values), "oh.expected.values");
+
+  // hand the tables to the runtime, which starts the verifier thread, from a
+  // module constructor
+  llvm::ArrayRef<llvm::Type *> register_params{
+      llvm::Type::getInt32PtrTy(Ctx), llvm::Type::getInt64PtrTy(Ctx), int32_ty};
+  llvm::FunctionType *register_type = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(Ctx), register_params, false);
+  llvm::Constant *register_func =
+      M.getOrInsertFunction("oh_register_expected_hashes", register_type);
+
+  llvm::FunctionType *ctor_type =
+      llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), false);
+  llvm::Function *ctor =
+      llvm::Function::Create(ctor_type, llvm::GlobalValue::InternalLinkage,
+                             "oh.register.expected", &M);
+  llvm::IRBuilder<> builder(llvm::BasicBlock::Create(Ctx, "entry", ctor));
+  builder.CreateCall(
+      register_func,
+      {builder.CreateConstInBoundsGEP2_32(offsets_type, offsets_table, 0, 0),
+       builder.CreateConstInBoundsGEP2_32(values_type, values_table, 0, 0),
+       builder.getInt32(sites_count)});
+  builder.CreateRetVoid();
+  llvm::appendToGlobalCtors(M, ctor, 0);
+}
+
+bool AssertionFinalizePass::setup_expected_table(llvm::Module &M,
+                                                 unsigned sites_count) {
+  llvm::LLVMContext &Ctx = M.getContext();
+  llvm::ArrayRef<llvm::Type *> table_params{llvm::Type::getInt32Ty(Ctx),
+                                            llvm::Type::getInt64PtrTy(Ctx)};
+  llvm::FunctionType *table_type = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(Ctx), table_params, false);
+  assert_table = llvm::dyn_cast<llvm::Function>(
+      M.getOrInsertFunction("oh_assert_table", table_type));
+  assert_table->setDoesNotThrow();
+
+  // sorted candidates of every site, identical candidate sets are stored once
+  std::vector<oh_expected::site_range> ranges(sites_count,
+                                              oh_expected::site_range{0, 0});
+  std::vector<uint64_t> values;
+  std::map<std::vector<uint64_t>, uint32_t> candidate_sets;
+  for (unsigned id = 0; id < sites_count; ++id) {
+    if (!has_precomputed_hashes(id)) {
+      continue;
+    }
+    std::vector<uint64_t> site_hashes(hashes[id].begin(), hashes[id].end());
+    std::sort(site_hashes.begin(), site_hashes.end());
+    auto set = candidate_sets.insert(
+        std::make_pair(site_hashes, static_cast<uint32_t>(values.size())));
+    if (set.second) {
+      values.insert(values.end(), site_hashes.begin(), site_hashes.end());
+    }
+    ranges[id] = oh_expected::site_range{set.first->second,
+                                         static_cast<uint32_t>(site_hashes.size())};
+  }
+  const oh_expected::header header{oh_expected::magic, oh_expected::version,
+                                   sites_count,
+                                   static_cast<uint32_t>(values.size())};
+  std::vector<char> table(
+      oh_expected::table_size(header.sites_count, header.values_count));
+  char *position = table.data();
+  std::memcpy(position, &header, sizeof(header));
+  position += sizeof(header);
+  std::memcpy(position, ranges.data(), ranges.size() * sizeof(ranges[0]));
+  position += ranges.size() * sizeof(ranges[0]);
+  std::memcpy(position, values.data(), values.size() * sizeof(values[0]));
+  llvm::dbgs() << "Expected hashes table: " << sites_count << " sites, "
+               << values.size() << " distinct values, " << table.size()
+               << " bytes\n";
+
+  if (expected_storage == ExpectedStorage::Section) {
+    // the linker defines __start_oh_expected and __stop_oh_expected around
+    // the section, llvm.used keeps the table alive
+    auto *data = llvm::ConstantDataArray::get(
+        Ctx, llvm::ArrayRef<uint8_t>(
+                 reinterpret_cast<const uint8_t *>(table.data()), table.size()));
+    auto *table_global = new llvm::GlobalVariable(
+        M, data->getType(), true, llvm::GlobalValue::InternalLinkage, data,
+        "oh.expected.table");
+    table_global->setSection("oh_expected");
+    table_global->setAlignment(8);
+    llvm::appendToUsed(M, {table_global});
+    return true;
+  }
+
+  std::ofstream table_file(expected_file, std::ios::binary | std::ios::trunc);
+  if (!table_file.is_open()) {
+    llvm::errs() << "ERR. cannot write expected hashes table " << expected_file
+                 << "\n";
+    return false;
+  }
+  table_file.write(table.data(), table.size());
+  // the runtime finds the file by the path recorded in the program
+  llvm::SmallString<128> path(expected_file);
+  llvm::sys::fs::make_absolute(path);
+  auto *path_data = llvm::ConstantDataArray::getString(Ctx, path.str());
+  new llvm::GlobalVariable(M, path_data->getType(), true,
+                           llvm::GlobalValue::ExternalLinkage, path_data,
+                           "oh_expected_file");
+  return true;
+}
+
+void AssertionFinalizePass::insert_table_check(llvm::CallInst *log_call) {
+  const unsigned log_id = get_site_id(log_call);
+  if (!has_precomputed_hashes(log_id)) {
+    return;
+  }
+  llvm::IRBuilder<> builder(log_call);
+  builder.CreateCall(assert_table,
+                     {log_call->getArgOperand(0), log_call->getArgOperand(1)});
+  log_call->eraseFromParent();
+}
+
+void AssertionFinalizePass::setup_sampling(llvm::Module &M,
+                                           unsigned sites_count,
+                                           bool thread_local_hashes) {
+  llvm::LLVMContext &Ctx = M.getContext();
+  // per site number of executions left until the next check, zero
+  // initialized so that the first execution of every site is checked. Every
+  // thread counts down its own copy when the hash variables are thread local
+  // (-oh-thread-local-hashes), otherwise the threads share the countdown
+  // with relaxed atomic loads and stores.
+  auto *countdown_type =
+      llvm::ArrayType::get(llvm::Type::getInt32Ty(Ctx), sites_count);
+  sample_countdown = new llvm::GlobalVariable(
+      M, countdown_type, false, llvm::GlobalValue::InternalLinkage,
+      llvm::ConstantAggregateZero::get(countdown_type), "oh.sample.countdown",
+      nullptr,
+      thread_local_hashes ? llvm::GlobalValue::InitialExecTLSModel
+                          : llvm::GlobalValue::NotThreadLocal);
+
+  // id, base rate, back-off streak and max interval; returns the countdown
+  // until the next check of the site
+  llvm::ArrayRef<llvm::Type *> rearm_params{
+      llvm::Type::getInt32Ty(Ctx), llvm::Type::getInt32Ty(Ctx),
+      llvm::Type::getInt32Ty(Ctx), llvm::Type::getInt32Ty(Ctx)};
+  llvm::FunctionType *rearm_type = llvm::FunctionType::get(
+      llvm::Type::getInt32Ty(Ctx), rearm_params, false);
+  sample_rearm = llvm::dyn_cast<llvm::Function>(
+      M.getOrInsertFunction("oh_sample_rearm", rearm_type));
+  sample_rearm->setDoesNotThrow();
+}
+
+void AssertionFinalizePass::insert_sampling_gate(llvm::CallInst *log_call) {
+  const unsigned log_id = get_site_id(log_call);
+  if (!has_precomputed_hashes(log_id)) {
+    return;
+  }
+  llvm::LLVMContext &Ctx = log_call->getModule()->getContext();
+  llvm::Type *int32_ty = llvm::Type::getInt32Ty(Ctx);
+  const unsigned rate = std::max(1u, sample_rate.getValue());
+
+  // gate_block: decrement the countdown, branch to check when it hits zero
+  // check_block: the assertion followed by rearming the countdown
+  // skip_block: stores the decremented countdown
+  llvm::BasicBlock *gate_block = log_call->getParent();
+  llvm::BasicBlock *cont_block = gate_block->splitBasicBlock(
+      std::next(log_call->getIterator()), "oh.sample.cont");
+  llvm::BasicBlock *check_block =
+      gate_block->splitBasicBlock(log_call, "oh.sample.check");
+  gate_block->getTerminator()->eraseFromParent();
+  llvm::BasicBlock *skip_block = llvm::BasicBlock::Create(
+      Ctx, "oh.sample.skip", gate_block->getParent(), check_block);
+
+  llvm::IRBuilder<> builder(gate_block);
+  llvm::Value *slot = builder.CreateConstInBoundsGEP2_32(
+      sample_countdown->getValueType(), sample_countdown, 0, log_id);
+  const bool shared = !sample_countdown->isThreadLocal();
+  auto *countdown = builder.CreateLoad(slot);
+  set_countdown_access(countdown, shared);
+  llvm::Value *due = builder.CreateICmpEQ(countdown, builder.getInt32(0));
+  llvm::Value *expected_due =
+      builder.CreateCall(expect, {due, builder.getFalse()});
+  builder.CreateCondBr(expected_due, check_block, skip_block);
+
+  builder.SetInsertPoint(skip_block);
+  set_countdown_access(
+      builder.CreateStore(builder.CreateSub(countdown, builder.getInt32(1)),
+                          slot),
+      shared);
+  builder.CreateBr(cont_block);
+
+  // failed checks abort, so the countdown is rearmed only after a pass
+  builder.SetInsertPoint(check_block->getTerminator());
+  llvm::Value *next_countdown = nullptr;
+  if (sample_backoff == 0) {
+    next_countdown = llvm::ConstantInt::get(int32_ty, rate - 1);
+  } else {
+    next_countdown = builder.CreateCall(
+        sample_rearm,
+        {log_call->getArgOperand(0), builder.getInt32(rate),
+         builder.getInt32(sample_backoff), builder.getInt32(sample_max_interval)});
+  }
+  set_countdown_access(builder.CreateStore(next_countdown, slot), shared);
+}
+
 static llvm::RegisterPass<AssertionFinalizePass>
     X("insert-asserts-finalize", "Inserts finalized assertions for hashes");
 }
@@ -3,7 +3,9 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Pass.h"
 
+#include <map>
 #include <unordered_set>
+#include <vector>
 
 namespace llvm {
 class CallInst;
@@ -26,10 +28,33 @@ private:
   void parse_hashes();
   void setup_assert_function(llvm::Module &M);
   void process_log_call(llvm::CallInst *log_call);
+  void insert_inline_check(llvm::CallInst *log_call);
+  void insert_outlined_check(llvm::CallInst *log_call);
+  llvm::Function *get_cold_check(llvm::Module &M,
+                                 const std::vector<uint64_t> &expected_hashes);
+  void insert_async_check(llvm::CallInst *log_call);
+  bool setup_expected_table(llvm::Module &M, unsigned sites_count);
+  void insert_table_check(llvm::CallInst *log_call);
+  void setup_async_verifier(llvm::Module &M, unsigned sites_count);
+  void setup_sampling(llvm::Module &M, unsigned sites_count,
+                      bool thread_local_hashes);
+  void insert_sampling_gate(llvm::CallInst *log_call);
+  llvm::CallInst *add_precomputed_site(llvm::CallInst *input_dep_call);
+  bool has_precomputed_hashes(unsigned log_id) const;
 
 private:
   using hash_value_set = std::unordered_set<uint64_t>;
   std::vector<hash_value_set> hashes;
   llvm::Function *assert;
+  llvm::Function *dumper;
+  llvm::Function *assert_failed;
+  llvm::Function *expect;
+  llvm::Function *assert_async;
+  llvm::Function *assert_table;
+  llvm::Function *telemetry_check;
+  llvm::Function *sample_rearm;
+  llvm::GlobalVariable *sample_countdown;
+  // outlined slow paths, shared by the sites expecting the same hashes
+  std::map<std::vector<uint64_t>, llvm::Function *> cold_checks;
 };
 }
@@ -1,7 +1,6 @@
 #include "AssertionInsertionPass.h"
 #include "ObliviousHashInsertion.h"
-
-#include "Utils.h"
+#include "TrainingHashes.h"
 
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
@@ -18,7 +17,6 @@
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
 #include <cassert>
-#include <fstream>
 #include <list>
 
 namespace oh {
@@ -30,7 +28,6 @@ bool AssertionInsertionPass::runOnModule(llvm::Module &M) {
 
   bool modified = false;
   parse_hashes();
-  unique_id_generator::get().reset();
   setup_assert_function(M);
   std::list<llvm::CallInst *> log_calls;
   for (auto &F : M) {
@@ -57,24 +54,13 @@ bool AssertionInsertionPass::runOnModule(llvm::Module &M) {
 }
 
 void AssertionInsertionPass::parse_hashes() {
-  hashes.resize(100000);
-  std::ifstream hash_strm;
-  hash_strm.open("hashes.log");
-  if(!hash_strm.good()){
-    llvm::errs()<<"ERR. hashes.log file cannot be found!\n";
+  auto &training = TrainingHashes::get(TrainingHashes::Log);
+  // hashes collected by an in-process training run take precedence
+  if (!training.is_collected() && !training.read_log("hashes.log")) {
+    llvm::errs() << "ERR. hashes.log file cannot be found!\n";
     exit(1);
   }
-  std::string id_str;
-  std::string hash_str;
-  while (!hash_strm.eof()) {
-    hash_strm >> id_str;
-    hash_strm >> hash_str;
-    unsigned id = std::stoi(id_str);
-    uint64_t hash = std::stoull(hash_str);
-    // llvm::dbgs() << id << " " << hash << "\n";
-    hashes[id].insert(hash);
-  }
-  hash_strm.close();
+  hashes = training.get_sites();
 }
 
 void AssertionInsertionPass::setup_assert_function(llvm::Module &M) {
@@ -91,11 +77,14 @@ void AssertionInsertionPass::setup_assert_function(llvm::Module &M) {
 }
 
 void AssertionInsertionPass::process_log_call(llvm::CallInst *log_call) {
-  const unsigned log_id = unique_id_generator::get().next();
-  const auto &precomputed_hashes = hashes[log_id];
-  if (precomputed_hashes.empty()) {
+  // the logger keeps its site id, independent of the order loggers are met
+  const unsigned log_id =
+      llvm::cast<llvm::ConstantInt>(log_call->getArgOperand(0))->getZExtValue();
+  // sites past the last logged id were never reached in training
+  if (log_id >= hashes.size() || hashes[log_id].empty()) {
     return;
   }
+  const auto &precomputed_hashes = hashes[log_id];
   // llvm::dbgs() << "log_id " << log_id << " hash values: ";
 
   llvm::LLVMContext &Ctx = log_call->getModule()->getContext();
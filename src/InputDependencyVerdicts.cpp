@@ -0,0 +1,96 @@
+#include "InputDependencyVerdicts.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Metadata.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace oh {
+
+namespace {
+
+const char *verdicts_kind = "oh.input.dependency";
+
+// !{i32 size, i64 word...}, bit i is bit i % 64 of word i / 64
+llvm::MDNode *encode_bits(llvm::LLVMContext &Ctx, const llvm::BitVector &bits) {
+  std::vector<llvm::Metadata *> operands{llvm::ConstantAsMetadata::get(
+      llvm::ConstantInt::get(llvm::Type::getInt32Ty(Ctx), bits.size()))};
+  for (unsigned begin = 0; begin < bits.size(); begin += 64) {
+    uint64_t word = 0;
+    for (unsigned bit = 0; bit < 64 && begin + bit < bits.size(); ++bit) {
+      if (bits.test(begin + bit)) {
+        word |= uint64_t(1) << bit;
+      }
+    }
+    operands.push_back(llvm::ConstantAsMetadata::get(
+        llvm::ConstantInt::get(llvm::Type::getInt64Ty(Ctx), word)));
+  }
+  return llvm::MDNode::get(Ctx, operands);
+}
+
+bool decode_bits(const llvm::Metadata *metadata, llvm::BitVector &bits) {
+  auto *node = llvm::dyn_cast_or_null<llvm::MDNode>(metadata);
+  if (node == nullptr || node->getNumOperands() == 0) {
+    return false;
+  }
+  auto *size = llvm::mdconst::dyn_extract<llvm::ConstantInt>(node->getOperand(0));
+  if (size == nullptr ||
+      node->getNumOperands() != 1 + (size->getZExtValue() + 63) / 64) {
+    return false;
+  }
+  bits.clear();
+  bits.resize(size->getZExtValue());
+  for (unsigned begin = 0; begin < bits.size(); begin += 64) {
+    auto *word = llvm::mdconst::dyn_extract<llvm::ConstantInt>(
+        node->getOperand(1 + begin / 64));
+    if (word == nullptr) {
+      return false;
+    }
+    for (unsigned bit = 0; bit < 64 && begin + bit < bits.size(); ++bit) {
+      if (word->getZExtValue() & (uint64_t(1) << bit)) {
+        bits.set(begin + bit);
+      }
+    }
+  }
+  return true;
+}
+}
+
+// !{i1 input_independent} for functions that are not instrumented,
+// !{i1 true, !instructions, !blocks} for the others
+void write_verdicts(llvm::Function &F,
+                    const InputDependencyVerdicts &verdicts) {
+  llvm::LLVMContext &Ctx = F.getContext();
+  std::vector<llvm::Metadata *> operands{
+      llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(
+          llvm::Type::getInt1Ty(Ctx), verdicts.input_independent))};
+  if (verdicts.input_independent) {
+    operands.push_back(encode_bits(Ctx, verdicts.dependent_instructions));
+    operands.push_back(encode_bits(Ctx, verdicts.nondeterministic_blocks));
+  }
+  F.setMetadata(verdicts_kind, llvm::MDNode::get(Ctx, operands));
+}
+
+bool read_verdicts(const llvm::Function &F,
+                   InputDependencyVerdicts &verdicts) {
+  auto *node = F.getMetadata(verdicts_kind);
+  if (node == nullptr || node->getNumOperands() == 0) {
+    return false;
+  }
+  auto *independent =
+      llvm::mdconst::dyn_extract<llvm::ConstantInt>(node->getOperand(0));
+  if (independent == nullptr) {
+    return false;
+  }
+  verdicts.input_independent = independent->isOne();
+  if (!verdicts.input_independent) {
+    return true;
+  }
+  return node->getNumOperands() == 3 &&
+         decode_bits(node->getOperand(1), verdicts.dependent_instructions) &&
+         decode_bits(node->getOperand(2), verdicts.nondeterministic_blocks);
+}
+
+} // namespace oh
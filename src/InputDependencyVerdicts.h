@@ -0,0 +1,27 @@
+#pragma once
+
+#include "llvm/ADT/BitVector.h"
+
+namespace llvm {
+class Function;
+}
+
+namespace oh {
+
+// Input dependency and non-determinism verdicts -oh-insert uses for a
+// function. They are stored in the oh.input.dependency metadata of the
+// function (-oh-save-input-dependency), so that later runs on the annotated
+// bitcode can skip the analyses (-oh-reuse-input-dependency).
+struct InputDependencyVerdicts {
+  // no hashes for functions called from non deterministic blocks
+  bool input_independent = false;
+  // by ordinal of the instruction in the function
+  llvm::BitVector dependent_instructions;
+  // by position of the block in the function
+  llvm::BitVector nondeterministic_blocks;
+};
+
+void write_verdicts(llvm::Function &F, const InputDependencyVerdicts &verdicts);
+bool read_verdicts(const llvm::Function &F, InputDependencyVerdicts &verdicts);
+
+} // namespace oh
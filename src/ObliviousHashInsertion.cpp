@@ -1,10 +1,20 @@
 #include "ObliviousHashInsertion.h"
 #include "AssertFunctionMarkPass.h"
+#include "InputDependencyVerdicts.h"
 #include "NonDeterministicBasicBlocksAnalysis.h"
+#include "ProfileSites.h"
 #include "Utils.h"
+#include "hash_kernels.h"
 #include "input-dependency/InputDependencyAnalysis.h"
 #include "input-dependency/InputDependentFunctions.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/InstrTypes.h"
@@ -12,11 +22,18 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <algorithm>
 #include <assert.h>
 #include <cstdlib>
 #include <ctime>
@@ -24,6 +41,9 @@
 #include <sstream>
 #include <vector>
 #include <iterator>
+#include <list>
+#include <set>
+#include <unordered_map>
 #include <boost/algorithm/string/classification.hpp> // Include boost::for is_any_of
 #include <boost/algorithm/string/split.hpp> // Include for boost::split
 using namespace llvm;
@@ -32,8 +52,197 @@ namespace oh {
 
 namespace {
 unsigned get_random(unsigned range) { return rand() % range; }
+
+bool get_chance(double probability) {
+  return rand() < probability * (static_cast<double>(RAND_MAX) + 1);
+}
+
+bool below_cap(unsigned count, unsigned cap) { return cap == 0 || count < cap; }
+
+// key of an associative hash site, a non zero element of the field
+uint64_t get_assoc_key() {
+  const uint64_t bits = (static_cast<uint64_t>(rand()) << 32) ^ rand();
+  return bits % (OH_ASSOC_PRIME - 1) + 1;
+}
+
+// a logger before a call checks the state before control leaves the function
+bool is_check_position(
+    llvm::Instruction &I,
+    const std::unordered_set<llvm::Value *> &runtime_functions) {
+  if (I.isTerminator()) {
+    return true;
+  }
+  auto *call = llvm::dyn_cast<llvm::CallInst>(&I);
+  if (call == nullptr) {
+    return false;
+  }
+  auto *called_function = call->getCalledFunction();
+  return called_function == nullptr ||
+         (!called_function->isIntrinsic() &&
+          runtime_functions.find(called_function) == runtime_functions.end());
+}
+
+// instructions instrumentInst hashes the value of
+bool is_hashed_instruction(const llvm::Instruction &I) {
+  if (auto *ret = llvm::dyn_cast<llvm::ReturnInst>(&I)) {
+    return ret->getReturnValue() != nullptr;
+  }
+  if (auto *bin = llvm::dyn_cast<llvm::BinaryOperator>(&I)) {
+    return bin->getOpcode() == llvm::Instruction::Add;
+  }
+  return llvm::isa<llvm::CmpInst>(I) || llvm::isa<llvm::LoadInst>(I);
+}
+
+// values a loop summary hashes, pointers differ between runs
+bool is_summary_type(llvm::Type *type) {
+  if (auto *vector_type = llvm::dyn_cast<llvm::VectorType>(type)) {
+    type = vector_type->getElementType();
+  }
+  return type->isIntegerTy() || type->isFloatingPointTy();
+}
+
+bool is_live_out(const llvm::Instruction &I, const llvm::Loop *L) {
+  for (const auto *user : I.users()) {
+    auto *user_inst = llvm::dyn_cast<llvm::Instruction>(user);
+    if (user_inst != nullptr && !L->contains(user_inst->getParent())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// the hash functions only update *hashVar, stating it lets alias analysis
+// move the loads and stores of the program across hash calls. Linking the
+// runtime replaces the attributes of the declarations with the ones of the
+// definitions, so calls get them as well.
+template <typename T> void add_hash_attributes(T *function_or_call) {
+  function_or_call->addAttribute(llvm::AttributeSet::FunctionIndex,
+                                 llvm::Attribute::NoUnwind);
+  function_or_call->addAttribute(llvm::AttributeSet::FunctionIndex,
+                                 llvm::Attribute::ArgMemOnly);
+  function_or_call->addAttribute(1, llvm::Attribute::NoCapture);
+  function_or_call->addAttribute(1, llvm::Attribute::NoAlias);
+}
+
+// oh_log reads *hashVar, its own state is not visible to the program
+template <typename T> void add_logger_attributes(T *function_or_call) {
+  function_or_call->addAttribute(llvm::AttributeSet::FunctionIndex,
+                                 llvm::Attribute::NoUnwind);
+  function_or_call->addAttribute(2, llvm::Attribute::NoCapture);
+  function_or_call->addAttribute(2, llvm::Attribute::ReadOnly);
+}
+
+// folds the lanes of a vector into one scalar, so vectorized code is hashed
+// without scalarizing it. Vectors of at most 64 bits are reinterpreted as an
+// integer. Wider ones become i64 lanes that are scaled by distinct odd
+// constants, so permuted lanes hash differently, and are xor folded in
+// halves.
+llvm::Value *fold_vector(llvm::IRBuilder<> &builder, llvm::Value *v) {
+  llvm::LLVMContext &Ctx = builder.getContext();
+  llvm::Type *i64_type = llvm::Type::getInt64Ty(Ctx);
+  auto *type = llvm::cast<llvm::VectorType>(v->getType());
+  unsigned lanes = type->getNumElements();
+  if (type->getElementType()->isPointerTy()) {
+    v = builder.CreatePtrToInt(v, llvm::VectorType::get(i64_type, lanes));
+  } else if (!type->getElementType()->isIntegerTy()) {
+    llvm::Type *lane_type =
+        llvm::Type::getIntNTy(Ctx, type->getScalarSizeInBits());
+    v = builder.CreateBitCast(v, llvm::VectorType::get(lane_type, lanes));
+  }
+  const unsigned bits = lanes * v->getType()->getScalarSizeInBits();
+  if (bits <= 64) {
+    return builder.CreateBitCast(v, llvm::Type::getIntNTy(Ctx, bits));
+  }
+  if (bits % 64 == 0) {
+    lanes = bits / 64;
+    v = builder.CreateBitCast(v, llvm::VectorType::get(i64_type, lanes));
+  } else {
+    v = builder.CreateZExtOrTrunc(v, llvm::VectorType::get(i64_type, lanes));
+  }
+
+  std::vector<llvm::Constant *> multipliers;
+  for (unsigned lane = 0; lane < lanes; ++lane) {
+    multipliers.push_back(
+        llvm::ConstantInt::get(i64_type, (2 * lane + 1) * 0x9e3779b97f4a7c15ULL));
+  }
+  v = builder.CreateMul(v, llvm::ConstantVector::get(multipliers));
+  // pad to a power of two lanes with zeros, they do not change the xor
+  unsigned width = llvm::NextPowerOf2(lanes - 1);
+  if (width != lanes) {
+    std::vector<uint32_t> mask;
+    for (unsigned lane = 0; lane < width; ++lane) {
+      mask.push_back(std::min(lane, lanes));
+    }
+    v = builder.CreateShuffleVector(
+        v, llvm::Constant::getNullValue(v->getType()),
+        llvm::ConstantDataVector::get(Ctx, mask));
+  }
+  while (width > 1) {
+    width /= 2;
+    std::vector<uint32_t> low;
+    std::vector<uint32_t> high;
+    for (unsigned lane = 0; lane < width; ++lane) {
+      low.push_back(lane);
+      high.push_back(width + lane);
+    }
+    llvm::Value *undef = llvm::UndefValue::get(v->getType());
+    v = builder.CreateXor(
+        builder.CreateShuffleVector(v, undef,
+                                    llvm::ConstantDataVector::get(Ctx, low)),
+        builder.CreateShuffleVector(v, undef,
+                                    llvm::ConstantDataVector::get(Ctx, high)));
+  }
+  return builder.CreateExtractElement(v, builder.getInt32(0));
+}
+
+// functions of a llvm.global_ctors or llvm.global_dtors list
+std::vector<llvm::Function *> get_structors(const llvm::Module &M,
+                                            const char *list_name) {
+  std::vector<llvm::Function *> structors;
+  auto *list = M.getNamedGlobal(list_name);
+  if (list == nullptr || !list->hasInitializer()) {
+    return structors;
+  }
+  auto *entries = llvm::dyn_cast<llvm::ConstantArray>(list->getInitializer());
+  if (entries == nullptr) {
+    return structors;
+  }
+  for (auto &entry : entries->operands()) {
+    auto *fields = llvm::dyn_cast<llvm::ConstantStruct>(entry.get());
+    if (fields == nullptr) {
+      continue;
+    }
+    if (auto *F = llvm::dyn_cast<llvm::Function>(
+            fields->getOperand(1)->stripPointerCasts())) {
+      structors.push_back(F);
+    }
+  }
+  return structors;
 }
 
+// whether code outside the module may call into it, other than main and the
+// constructors and destructors: a defined function has its address taken
+bool has_callbacks(const llvm::Module &M) {
+  std::unordered_set<const llvm::Function *> structors;
+  for (const char *list_name : {"llvm.global_ctors", "llvm.global_dtors"}) {
+    for (auto *F : get_structors(M, list_name)) {
+      structors.insert(F);
+    }
+  }
+  for (const auto &F : M) {
+    if (!F.isDeclaration() && F.getName() != "main" &&
+        structors.find(&F) == structors.end() && F.hasAddressTaken()) {
+      return true;
+    }
+  }
+  return false;
+}
+}
+
+enum PlacementStrategy { RandomPlacement, DominancePlacement };
+enum InsertionPoint { EarlyInsertion, LateInsertion };
+enum HashFamily { CrcPjwFamily, AssocFamily };
+
 char ObliviousHashInsertionPass::ID = 0;
 static llvm::cl::opt<unsigned>
     num_hash("num-hash", llvm::cl::desc("Specify number of hash values to use"),
@@ -44,16 +253,145 @@ static llvm::cl::opt<std::string> SkipTaggedInstructions(
     llvm::cl::desc("Specify comma separated tagged instructios (metadata) to be skipped by the OH pass"),
     llvm::cl::value_desc("skip"));
 
+static llvm::cl::opt<bool> ThreadLocalHashes(
+    "oh-thread-local-hashes",
+    llvm::cl::desc("Make hash variables thread local (initial-exec TLS) so "
+                   "that every thread computes and checks its own hashes"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<PlacementStrategy> Placement(
+    "oh-placement", llvm::cl::desc("Choose how loggers (later asserts) are placed"),
+    llvm::cl::values(
+        clEnumValN(RandomPlacement, "random",
+                   "before every call and randomly before other instructions"),
+        clEnumValN(DominancePlacement, "dominance",
+                   "at least one logger per hashed region using the dominator "
+                   "tree, plus randomly before calls"),
+        clEnumValEnd),
+    llvm::cl::init(RandomPlacement));
+
+static llvm::cl::opt<double> AssertDensity(
+    "oh-assert-density",
+    llvm::cl::desc("Probability of inserting a logger at a position that does "
+                   "not require one"),
+    llvm::cl::init(0.5));
+
+static llvm::cl::opt<unsigned> MaxAssertsPerBlock(
+    "oh-max-asserts-per-block",
+    llvm::cl::desc("Maximum number of loggers in a basic block, 0 for no limit"),
+    llvm::cl::init(0));
+
+static llvm::cl::opt<bool> Profile(
+    "oh-profile",
+    llvm::cl::desc("Count the executions of every hash update and logger site "
+                   "(link with assertions/profile.cpp)"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<std::string> ProfileMap(
+    "oh-profile-map",
+    llvm::cl::desc("Site map written with -oh-profile and read with "
+                   "-oh-profile-use"),
+    llvm::cl::value_desc("filename"), llvm::cl::init("oh_profile_map.txt"));
+
+static llvm::cl::opt<std::string> ProfileUse(
+    "oh-profile-use",
+    llvm::cl::desc("Profile of a previous -oh-profile build, its hot sites "
+                   "are not instrumented"),
+    llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<double> ProfileHotFraction(
+    "oh-profile-hot-fraction",
+    llvm::cl::desc("Fraction of all hits of its kind that makes a site hot"),
+    llvm::cl::init(0.05));
+
+static llvm::cl::opt<unsigned> MaxAssertsPerRegion(
+    "oh-max-asserts-per-region",
+    llvm::cl::desc("Maximum number of loggers checking a hashed region "
+                   "(dominance placement), 0 for no limit"),
+    llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned> MaxAssertsPerFunction(
+    "oh-max-asserts-per-function",
+    llvm::cl::desc("Maximum number of loggers in a function, 0 for no limit"),
+    llvm::cl::init(0));
+
+static llvm::cl::opt<InsertionPoint> InsertionPointOpt(
+    "oh-insertion-point",
+    llvm::cl::desc("Where the standard optimization pipeline runs -oh-insert"),
+    llvm::cl::values(
+        clEnumValN(EarlyInsertion, "early",
+                   "as early as possible, before the optimizations"),
+        clEnumValN(LateInsertion, "late",
+                   "after the optimizations (also at -O0), so hash calls do "
+                   "not block inlining, LICM, GVN and vectorization"),
+        clEnumValEnd),
+    llvm::cl::init(EarlyInsertion));
+
+static llvm::cl::opt<HashFamily> HashFamilyOpt(
+    "oh-hash-family",
+    llvm::cl::desc("Hash functions the inserted hash updates compute"),
+    llvm::cl::values(
+        clEnumValN(CrcPjwFamily, "crc-pjw",
+                   "CRC and PJW variants, randomly per site, order sensitive"),
+        clEnumValN(AssocFamily, "assoc",
+                   "sum of keyed terms over the field 2^61 - 1, updates of a "
+                   "hash variable may be reordered, combined or vectorized"),
+        clEnumValEnd),
+    llvm::cl::init(CrcPjwFamily));
+
+static llvm::cl::opt<bool> RuntimeAttributes(
+    "oh-runtime-attributes",
+    llvm::cl::desc("Declare that hash functions only access the hash variable "
+                   "and that no runtime call unwinds (turn off for hash.c "
+                   "built with OH_HASH_TRACE)"),
+    llvm::cl::init(true));
+
+static llvm::cl::opt<bool> LoopSummary(
+    "oh-loop-summary",
+    llvm::cl::desc("Hash deterministic loops with a computable trip count once "
+                   "at their exit (trip count, exit values and values used "
+                   "after the loop) instead of in every iteration"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<std::string> SaveInputDependency(
+    "oh-save-input-dependency",
+    llvm::cl::desc("Write the input bitcode, annotated with the input "
+                   "dependency verdicts used, for -oh-reuse-input-dependency"),
+    llvm::cl::value_desc("filename"));
 
+static llvm::cl::opt<bool> ReuseInputDependency(
+    "oh-reuse-input-dependency",
+    llvm::cl::desc("Take the input dependency verdicts from the metadata of "
+                   "bitcode written with -oh-save-input-dependency instead "
+                   "of running the analyses"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> PrecomputeConstants(
+    "oh-precompute-constants",
+    llvm::cl::desc("Compute the hashes of the loggers on the straight-line "
+                   "entry path of main at compile time when every hashed "
+                   "value is a constant, such sites need no training"),
+    llvm::cl::init(false));
+
+static llvm::cl::opt<bool> DumpPlan(
+    "oh-dump-plan",
+    llvm::cl::desc("Print the hash and logger sites planned for every function"),
+    llvm::cl::init(false));
 
 void ObliviousHashInsertionPass::getAnalysisUsage(
     llvm::AnalysisUsage &AU) const {
   AU.setPreservesAll();
-  AU.addRequired<input_dependency::InputDependencyAnalysis>();
-  AU.addRequired<input_dependency::InputDependentFunctionsPass>();
-  AU.addRequired<NonDeterministicBasicBlocksAnalysis>();
+  if (!ReuseInputDependency) {
+    AU.addRequired<input_dependency::InputDependencyAnalysis>();
+    AU.addRequired<input_dependency::InputDependentFunctionsPass>();
+    AU.addRequired<NonDeterministicBasicBlocksAnalysis>();
+  }
   AU.addRequired<llvm::LoopInfoWrapperPass>();
+  AU.addRequired<llvm::DominatorTreeWrapperPass>();
   AU.addRequired<AssertFunctionMarkPass>();
+  if (LoopSummary) {
+    AU.addRequired<llvm::ScalarEvolutionWrapperPass>();
+  }
 }
 
 void ObliviousHashInsertionPass::insertHash(llvm::Instruction &I,
@@ -68,11 +406,12 @@ void ObliviousHashInsertionPass::insertHash(llvm::Instruction &I,
     builder.SetInsertPoint(I.getParent(), builder.GetInsertPoint());
   else
     builder.SetInsertPoint(I.getParent(), ++builder.GetInsertPoint());
-  insertHashBuilder(builder, v);
+  insertHashBuilder(builder, v, &I);
 }
 
 bool ObliviousHashInsertionPass::insertHashBuilder(llvm::IRBuilder<> &builder,
-                                                   llvm::Value *v) {
+                                                   llvm::Value *v,
+                                                   llvm::Instruction *owner) {
   llvm::LLVMContext &Ctx = builder.getContext();
   llvm::Value *cast;
   llvm::Value *load;
@@ -80,8 +419,9 @@ bool ObliviousHashInsertionPass::insertHashBuilder(llvm::IRBuilder<> &builder,
      llvm::Type *ptrType = v->getType()->getPointerElementType();
      ptrType->print(dbgs(),true);
      dbgs()<<"\n";
-     if (!ptrType->isIntegerTy()){
-        dbgs()<<"Non integer pointers are skipped:";
+     if (!ptrType->isIntegerTy() && !ptrType->isFloatingPointTy() &&
+         !ptrType->isVectorTy()){
+        dbgs()<<"Pointers to aggregates are skipped:";
         v->print(dbgs(),true);
         ptrType->print(dbgs(),true);
         dbgs()<<"\n";
@@ -94,19 +434,50 @@ bool ObliviousHashInsertionPass::insertHashBuilder(llvm::IRBuilder<> &builder,
   } else {
      load = v;
   }
+  if (load->getType()->isVectorTy()) {
+    load = fold_vector(builder, load);
+  }
   
 
 
-  if (load->getType()->isIntegerTy())
-    cast = builder.CreateZExtOrBitCast(load, llvm::Type::getInt64Ty(Ctx));
-  else if (load->getType()->isPtrOrPtrVectorTy()){
+  // pick the entry point matching the value, narrow integers and floating
+  // point bit patterns are hashed without widening them to 64 bits
+  const HashFunctions &functions = get_random(2) ? hashFuncs1 : hashFuncs2;
+  llvm::Type *type = load->getType();
+  llvm::Constant *hashFunc = nullptr;
+  if (type->isIntegerTy()) {
+    const unsigned width = type->getIntegerBitWidth();
+    llvm::Type *cast_type = nullptr;
+    if (width <= 8) {
+      cast_type = llvm::Type::getInt8Ty(Ctx);
+      hashFunc = functions.i8;
+    } else if (width <= 16) {
+      cast_type = llvm::Type::getInt16Ty(Ctx);
+      hashFunc = functions.i16;
+    } else if (width <= 32) {
+      cast_type = llvm::Type::getInt32Ty(Ctx);
+      hashFunc = functions.i32;
+    } else {
+      // integers wider than 64 bits contribute their low 64 bits
+      cast_type = llvm::Type::getInt64Ty(Ctx);
+      hashFunc = functions.i64;
+    }
+    cast = builder.CreateZExtOrTrunc(load, cast_type);
+  } else if (type->isPtrOrPtrVectorTy()) {
     //This should never happen, pointer to pointer should not reach here
     assert(false);
-  }
-  else if (load->getType()->isFloatingPointTy())
-    cast = builder.CreateFPToSI(load, llvm::Type::getInt64Ty(Ctx));
-  else
+    return false;
+  } else if (type->isHalfTy() || type->isFloatTy()) {
+    cast = builder.CreateFPExt(load, llvm::Type::getFloatTy(Ctx));
+    hashFunc = functions.f32;
+  } else if (type->isFloatingPointTy()) {
+    // long double and friends are hashed as double
+    cast = builder.CreateFPTrunc(load, llvm::Type::getDoubleTy(Ctx));
+    hashFunc = functions.f64;
+  } else {
     assert(false);
+    return false;
+  }
 
   std::vector<llvm::Value *> arg_values;
   unsigned index = get_random(num_hash);
@@ -114,9 +485,46 @@ bool ObliviousHashInsertionPass::insertHashBuilder(llvm::IRBuilder<> &builder,
   arg_values.push_back(hashPtrs.at(index));
   arg_values.push_back(cast);
   llvm::ArrayRef<llvm::Value *> args(arg_values);
-  builder.CreateCall(get_random(2) ? hashFunc1 : hashFunc2, args);
+  llvm::Value *profile_start =
+      Profile ? insert_profile_begin(builder, ProfileSites::Hash, owner)
+              : nullptr;
+  if (HashFamilyOpt == AssocFamily) {
+    insert_assoc_update(builder, hashPtrs.at(index), cast);
+  } else {
+    auto *call = builder.CreateCall(hashFunc, args);
+    if (cast->getType()->isIntegerTy()) {
+      // narrow arguments are zero extended by the caller in the C ABI
+      call->addAttribute(2, llvm::Attribute::ZExt);
+    }
+    if (RuntimeAttributes) {
+      add_hash_attributes(call);
+    }
+  }
+  if (profile_start) {
+    insert_profile_end(builder, profile_start);
+  }
   return true;
 }
+// -oh-hash-family=assoc: *hashVar += hash_assoc_term(key, value). The term
+// does not access memory and the add wraps, so the updates of a hash
+// variable commute and the optimizer may reorder, combine or vectorize them.
+void ObliviousHashInsertionPass::insert_assoc_update(llvm::IRBuilder<> &builder,
+                                                     llvm::Value *hash_ptr,
+                                                     llvm::Value *value) {
+  llvm::Type *value_type = value->getType();
+  if (value_type->isFloatingPointTy()) {
+    value = builder.CreateBitCast(
+        value, builder.getIntNTy(value_type->getPrimitiveSizeInBits()));
+  }
+  value = builder.CreateZExt(value, builder.getInt64Ty());
+  auto *term =
+      builder.CreateCall(assocTerm, {builder.getInt64(get_assoc_key()), value});
+  term->setDoesNotAccessMemory();
+  term->setDoesNotThrow();
+  llvm::Value *hash = builder.CreateLoad(hash_ptr);
+  builder.CreateStore(builder.CreateAdd(hash, term), hash_ptr);
+}
+
 void ObliviousHashInsertionPass::parse_skip_tags(){
  if(!SkipTaggedInstructions.empty()){
    boost::split(skipTags, SkipTaggedInstructions, boost::is_any_of(","), boost::token_compress_on);
@@ -135,17 +543,18 @@ bool ObliviousHashInsertionPass::instrumentInst(llvm::Instruction &I) {
     builder.SetInsertPoint(I.getParent(), ++builder.GetInsertPoint());
 
     // Insert the transformation of the cmp output into something more usable by
-    // the hash function.
-    llvm::Value *cmpExt =
-        builder.CreateZExtOrBitCast(cmp, llvm::Type::getInt8Ty(Ctx));
+    // the hash function. Vector compares are transformed per lane.
+    llvm::Type *byteType = llvm::Type::getInt8Ty(Ctx);
+    if (auto *vectorType = llvm::dyn_cast<llvm::VectorType>(cmp->getType())) {
+      byteType = llvm::VectorType::get(byteType, vectorType->getNumElements());
+    }
+    llvm::Value *cmpExt = builder.CreateZExtOrBitCast(cmp, byteType);
     llvm::Value *val = builder.CreateAdd(
         builder.CreateMul(
-            llvm::ConstantInt::get(llvm::Type::getInt8Ty(Ctx), 64),
-            builder.CreateAdd(
-                cmpExt, llvm::ConstantInt::get(llvm::Type::getInt8Ty(Ctx), 1))),
-        llvm::ConstantInt::get(llvm::Type::getInt8Ty(Ctx),
-                               cmp->getPredicate()));
-    insertHashBuilder(builder, val);
+            llvm::ConstantInt::get(byteType, 64),
+            builder.CreateAdd(cmpExt, llvm::ConstantInt::get(byteType, 1))),
+        llvm::ConstantInt::get(byteType, cmp->getPredicate()));
+    insertHashBuilder(builder, val, &I);
   }
   if (llvm::ReturnInst::classof(&I)) {
     auto *ret = llvm::dyn_cast<llvm::ReturnInst>(&I);
@@ -210,6 +619,11 @@ void ObliviousHashInsertionPass::insertLogger(llvm::Instruction &I) {
   if (usedHashIndices.empty()) {
     return;
   }
+  if (!below_cap(blockLoggers[I.getParent()], MaxAssertsPerBlock) ||
+      !below_cap(functionLoggers, MaxAssertsPerFunction) ||
+      is_hot_site(ProfileSites::Log, I)) {
+    return;
+  }
   llvm::LLVMContext &Ctx = I.getModule()->getContext();
   llvm::IRBuilder<> builder(&I);
   builder.SetInsertPoint(I.getParent(), builder.GetInsertPoint());
@@ -228,23 +642,177 @@ void ObliviousHashInsertionPass::insertLogger(llvm::Instruction &I) {
   if (auto callInst = llvm::dyn_cast<llvm::CallInst>(&I)) {
     auto called_function = callInst->getCalledFunction();
     if (called_function != nullptr && !called_function->isIntrinsic() &&
-        called_function != hashFunc1 && called_function != hashFunc2) {
+        !is_runtime_function(called_function)) {
       // always insert logger before call instructions
       insertLogger(builder, I, random_hash_idx);
       return;
     }
   }
-  if (get_random(2)) {
+  if (get_chance(AssertDensity)) {
     // insert randomly
     insertLogger(builder, I, random_hash_idx);
   }
 }
 
+bool ObliviousHashInsertionPass::place_loggers(
+    llvm::Function &F, const llvm::LoopInfo &LI, const BlockHashes &block_hashes,
+    const std::unordered_set<llvm::BasicBlock *> &check_blocks) {
+  auto &DT = getAnalysis<llvm::DominatorTreeWrapperPass>(F).getDomTree();
+  // a region is a hashed block, hashes updated in a loop nest belong to the
+  // region of its outermost header as loggers are never placed in loops
+  std::unordered_map<llvm::BasicBlock *, std::set<unsigned>> regions;
+  std::unordered_map<llvm::BasicBlock *, llvm::BasicBlock *> block_regions;
+  for (const auto &block : block_hashes) {
+    llvm::BasicBlock *root = block.first;
+    if (DT.getNode(root) == nullptr) {
+      continue;
+    }
+    if (auto *loop = LI.getLoopFor(root)) {
+      while (loop->getParentLoop() != nullptr) {
+        loop = loop->getParentLoop();
+      }
+      root = loop->getHeader();
+    }
+    regions[root].insert(block.second.begin(), block.second.end());
+    block_regions[block.first] = root;
+  }
+  if (regions.empty()) {
+    return false;
+  }
+
+  // hash indices logged before an instruction
+  std::unordered_map<llvm::Instruction *, std::vector<unsigned>> checks;
+  std::unordered_map<llvm::BasicBlock *, std::set<unsigned>> block_indices;
+  std::unordered_map<llvm::BasicBlock *, unsigned> block_checks;
+  std::unordered_map<llvm::BasicBlock *, unsigned> region_checks;
+  unsigned function_checks = 0;
+  auto add_check = [&](llvm::Instruction *position, llvm::BasicBlock *region,
+                       unsigned index) {
+    checks[position].push_back(index);
+    block_indices[position->getParent()].insert(index);
+    ++block_checks[position->getParent()];
+    ++region_checks[region];
+    ++function_checks;
+  };
+
+  // every block dominated by a region observes its hash updates. Walk the
+  // dominator tree bottom up and give a region a logger for each hash it
+  // updates that no block it dominates logs yet, in the region itself or
+  // the closest dominated block a logger may be put in. These loggers
+  // override the block and region limits, which only bound the additional
+  // loggers below.
+  std::unordered_map<llvm::BasicBlock *, std::set<unsigned>> covered;
+  for (auto *node : llvm::post_order(DT.getRootNode())) {
+    llvm::BasicBlock *B = node->getBlock();
+    std::set<unsigned> &logged = covered[B];
+    auto own = block_indices.find(B);
+    if (own != block_indices.end()) {
+      logged.insert(own->second.begin(), own->second.end());
+    }
+    for (auto *child : *node) {
+      const auto &child_logged = covered[child->getBlock()];
+      logged.insert(child_logged.begin(), child_logged.end());
+    }
+    auto region = regions.find(B);
+    if (region == regions.end()) {
+      continue;
+    }
+    std::vector<unsigned> missing;
+    std::set_difference(region->second.begin(), region->second.end(),
+                        logged.begin(), logged.end(),
+                        std::back_inserter(missing));
+    if (missing.empty()) {
+      continue;
+    }
+    llvm::BasicBlock *target = nullptr;
+    std::list<llvm::DomTreeNode *> worklist{node};
+    while (!worklist.empty() && target == nullptr) {
+      auto *candidate = worklist.front();
+      worklist.pop_front();
+      if (check_blocks.count(candidate->getBlock())) {
+        target = candidate->getBlock();
+      }
+      worklist.insert(worklist.end(), candidate->begin(), candidate->end());
+    }
+    if (target == nullptr) {
+      llvm::dbgs() << "No block to check hashes of " << B->getName()
+                   << " in function " << F.getName() << "\n";
+      continue;
+    }
+    if (is_hot_site(ProfileSites::Log, *target->getTerminator())) {
+      llvm::dbgs() << "Logger checking " << B->getName()
+                   << " skipped, it is hot in the profile\n";
+      continue;
+    }
+    for (unsigned index : missing) {
+      if (!below_cap(function_checks, MaxAssertsPerFunction)) {
+        llvm::dbgs() << "Function " << F.getName()
+                     << " reached the logger limit, hash " << index << " of "
+                     << B->getName() << " is not checked\n";
+        break;
+      }
+      if (!below_cap(block_checks[target], MaxAssertsPerBlock) ||
+          !below_cap(region_checks[B], MaxAssertsPerRegion)) {
+        llvm::dbgs() << "Logger checking hash " << index << " of "
+                     << B->getName()
+                     << " exceeds the block or region logger limit\n";
+      }
+      add_check(target->getTerminator(), B, index);
+      logged.insert(index);
+    }
+  }
+
+  // additional loggers before calls and block ends, with the configured
+  // density and within the limits
+  for (auto &B : F) {
+    auto hashes = block_hashes.find(&B);
+    auto region = block_regions.find(&B);
+    if (!check_blocks.count(&B) || hashes == block_hashes.end() ||
+        region == block_regions.end()) {
+      continue;
+    }
+    for (auto &I : B) {
+      if (!below_cap(block_checks[&B], MaxAssertsPerBlock) ||
+          !below_cap(function_checks, MaxAssertsPerFunction)) {
+        break;
+      }
+      if (!is_check_position(I, runtimeFunctions) || checks.count(&I) ||
+          !below_cap(region_checks[region->second], MaxAssertsPerRegion) ||
+          !get_chance(AssertDensity)) {
+        continue;
+      }
+      if (!is_hot_site(ProfileSites::Log, I)) {
+        add_check(&I, region->second,
+                  hashes->second.at(get_random(hashes->second.size())));
+      }
+    }
+  }
+
+  // insert in program order, so log ids follow the module layout
+  for (auto &B : F) {
+    std::vector<llvm::Instruction *> positions;
+    for (auto &I : B) {
+      if (checks.count(&I)) {
+        positions.push_back(&I);
+      }
+    }
+    for (auto *I : positions) {
+      for (unsigned index : checks[I]) {
+        llvm::IRBuilder<> builder(I);
+        insertLogger(builder, *I, index);
+      }
+    }
+  }
+  return !checks.empty();
+}
+
 void ObliviousHashInsertionPass::insertLogger(llvm::IRBuilder<> &builder,
                                               llvm::Instruction &instr,
                                               unsigned hashToLogIdx) {
   builder.SetInsertPoint(instr.getParent(), builder.GetInsertPoint());
   llvm::LLVMContext &Ctx = builder.getContext();
+  ++blockLoggers[instr.getParent()];
+  ++functionLoggers;
 
   std::vector<llvm::Value *> arg_values;
   unsigned id = unique_id_generator::get().next();
@@ -254,7 +822,96 @@ void ObliviousHashInsertionPass::insertLogger(llvm::IRBuilder<> &builder,
   arg_values.push_back(id_value);
   arg_values.push_back(hashPtrs.at(hashToLogIdx));
   llvm::ArrayRef<llvm::Value *> args(arg_values);
-  builder.CreateCall(logger, args);
+  llvm::Value *profile_start =
+      Profile ? insert_profile_begin(builder, ProfileSites::Log,
+                                     owning_instruction(instr))
+              : nullptr;
+  auto *call = builder.CreateCall(logger, args);
+  if (RuntimeAttributes) {
+    add_logger_attributes(call);
+  }
+  if (profile_start) {
+    insert_profile_end(builder, profile_start);
+  }
+}
+
+// owner is the original instruction the inserted code belongs to, the site
+// is profiled under its function and ordinal
+llvm::Value *
+ObliviousHashInsertionPass::insert_profile_begin(llvm::IRBuilder<> &builder,
+                                                 ProfileSites::Kind kind,
+                                                 llvm::Instruction *owner) {
+  assert(owner != nullptr && "profiled code without an original instruction");
+  if (owner == nullptr) {
+    return nullptr;
+  }
+  const unsigned id =
+      profileSites.add_site(kind, *owner, instructionOrdinals.at(owner));
+  return builder.CreateCall(profileBegin, {builder.getInt32(id)});
+}
+
+void ObliviousHashInsertionPass::insert_profile_end(llvm::IRBuilder<> &builder,
+                                                    llvm::Value *start) {
+  auto *id = llvm::cast<llvm::CallInst>(start)->getArgOperand(0);
+  builder.CreateCall(profileEnd, {id, start});
+}
+
+void ObliviousHashInsertionPass::setup_profiling(llvm::Module &M) {
+  llvm::LLVMContext &Ctx = M.getContext();
+  // oh_profile_begin(id) counts a hit of the site and returns the cycle
+  // counter when the hit is sampled, 0 otherwise. oh_profile_end(id, start)
+  // accounts the cycles spent since a sampled begin.
+  llvm::FunctionType *begin_type = llvm::FunctionType::get(
+      llvm::Type::getInt64Ty(Ctx), {llvm::Type::getInt32Ty(Ctx)}, false);
+  profileBegin = M.getOrInsertFunction("oh_profile_begin", begin_type);
+  llvm::FunctionType *end_type = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(Ctx),
+      {llvm::Type::getInt32Ty(Ctx), llvm::Type::getInt64Ty(Ctx)}, false);
+  profileEnd = M.getOrInsertFunction("oh_profile_end", end_type);
+  runtimeFunctions.insert(profileBegin);
+  runtimeFunctions.insert(profileEnd);
+}
+
+void ObliviousHashInsertionPass::finish_profiling(llvm::Module &M) {
+  llvm::LLVMContext &Ctx = M.getContext();
+  llvm::FunctionType *init_type = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(Ctx), {llvm::Type::getInt32Ty(Ctx)}, false);
+  llvm::Constant *init = M.getOrInsertFunction("oh_profile_init", init_type);
+  llvm::FunctionType *ctor_type =
+      llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), false);
+  llvm::Function *ctor =
+      llvm::Function::Create(ctor_type, llvm::GlobalValue::InternalLinkage,
+                             "oh.profile.init", &M);
+  llvm::IRBuilder<> builder(llvm::BasicBlock::Create(Ctx, "entry", ctor));
+  builder.CreateCall(init, {builder.getInt32(profileSites.size())});
+  builder.CreateRetVoid();
+  llvm::appendToGlobalCtors(M, ctor, 0);
+  profileSites.write_map(ProfileMap);
+  llvm::dbgs() << "Profiling " << profileSites.size() << " sites, map written to "
+               << ProfileMap << "\n";
+}
+
+bool ObliviousHashInsertionPass::is_hot_site(ProfileSites::Kind kind,
+                                             llvm::Instruction &I) const {
+  if (ProfileUse.empty()) {
+    return false;
+  }
+  auto ordinal = instructionOrdinals.find(&I);
+  return ordinal != instructionOrdinals.end() &&
+         profileSites.is_hot(kind, I.getFunction()->getName().str(),
+                             ordinal->second);
+}
+
+// I itself when it is in the plan, otherwise the next planned instruction
+// of its block: code inserted before it, e.g. a loop summary, belongs to it
+llvm::Instruction *
+ObliviousHashInsertionPass::owning_instruction(llvm::Instruction &I) const {
+  for (auto it = I.getIterator(); it != I.getParent()->end(); ++it) {
+    if (instructionOrdinals.count(&*it)) {
+      return &*it;
+    }
+  }
+  return nullptr;
 }
 
 void ObliviousHashInsertionPass::end_logging(llvm::Instruction &I) {
@@ -272,14 +929,55 @@ void ObliviousHashInsertionPass::end_logging(llvm::Instruction &I) {
   builder.CreateCall(logger, args);
 }
 
+bool ObliviousHashInsertionPass::is_hash_function(llvm::Function *F) const {
+  return hashFunctions.find(F) != hashFunctions.end();
+}
+
+bool ObliviousHashInsertionPass::is_hash_variable(llvm::Value *v) const {
+  return std::find(hashPtrs.begin(), hashPtrs.end(), v) != hashPtrs.end();
+}
+
+bool ObliviousHashInsertionPass::is_runtime_function(llvm::Function *F) const {
+  return runtimeFunctions.find(F) != runtimeFunctions.end();
+}
+
+void ObliviousHashInsertionPass::setup_hash_functions(
+    llvm::Module &M, const std::string &name, HashKernel::hash_type kernel,
+    HashFunctions &functions) {
+  llvm::LLVMContext &Ctx = M.getContext();
+  auto get_function = [&](const std::string &suffix, llvm::Type *value_type) {
+    llvm::ArrayRef<llvm::Type *> params{llvm::Type::getInt64PtrTy(Ctx),
+                                        value_type};
+    llvm::FunctionType *function_type =
+        llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), params, false);
+    llvm::Constant *function =
+        M.getOrInsertFunction(name + "_" + suffix, function_type);
+    if (auto *F = llvm::dyn_cast<llvm::Function>(function)) {
+      if (value_type->isIntegerTy()) {
+        F->addAttribute(2, llvm::Attribute::ZExt);
+      }
+      if (RuntimeAttributes) {
+        add_hash_attributes(F);
+      }
+    }
+    hashFunctions.insert(function);
+    hashKernels[function] =
+        HashKernel{kernel, value_type->getPrimitiveSizeInBits() / 8};
+    runtimeFunctions.insert(function);
+    return function;
+  };
+  functions.i8 = get_function("i8", llvm::Type::getInt8Ty(Ctx));
+  functions.i16 = get_function("i16", llvm::Type::getInt16Ty(Ctx));
+  functions.i32 = get_function("i32", llvm::Type::getInt32Ty(Ctx));
+  functions.i64 = get_function("i64", llvm::Type::getInt64Ty(Ctx));
+  functions.f32 = get_function("f32", llvm::Type::getFloatTy(Ctx));
+  functions.f64 = get_function("f64", llvm::Type::getDoubleTy(Ctx));
+}
+
 void ObliviousHashInsertionPass::setup_functions(llvm::Module &M) {
   llvm::LLVMContext &Ctx = M.getContext();
-  llvm::ArrayRef<llvm::Type *> params{llvm::Type::getInt64PtrTy(Ctx),
-                                      llvm::Type::getInt64Ty(Ctx)};
-  llvm::FunctionType *function_type =
-      llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), params, false);
-  hashFunc1 = M.getOrInsertFunction("hash1", function_type);
-  hashFunc2 = M.getOrInsertFunction("hash2", function_type);
+  setup_hash_functions(M, "hash1", oh_hash1_bytes, hashFuncs1);
+  setup_hash_functions(M, "hash2", oh_hash2_bytes, hashFuncs2);
 
   // arguments of logger are line and column number of instruction and hash
   // variable to log
@@ -288,34 +986,572 @@ void ObliviousHashInsertionPass::setup_functions(llvm::Module &M) {
   llvm::FunctionType *logger_type =
       llvm::FunctionType::get(llvm::Type::getVoidTy(Ctx), logger_params, false);
   logger = M.getOrInsertFunction("oh_log", logger_type);
+  if (auto *F = llvm::dyn_cast<llvm::Function>(logger)) {
+    if (RuntimeAttributes) {
+      add_logger_attributes(F);
+    }
+  }
+  runtimeFunctions.insert(logger);
+  if (HashFamilyOpt == AssocFamily) {
+    llvm::Type *i64_type = llvm::Type::getInt64Ty(Ctx);
+    llvm::FunctionType *term_type =
+        llvm::FunctionType::get(i64_type, {i64_type, i64_type}, false);
+    assocTerm = M.getOrInsertFunction("hash_assoc_term", term_type);
+    if (auto *F = llvm::dyn_cast<llvm::Function>(assocTerm)) {
+      F->setDoesNotAccessMemory();
+      F->setDoesNotThrow();
+    }
+    hashFunctions.insert(assocTerm);
+    runtimeFunctions.insert(assocTerm);
+  }
+  if (PrecomputeConstants) {
+    // id, hash variable and the hash expected there
+    llvm::ArrayRef<llvm::Type *> input_dep_params{
+        llvm::Type::getInt32Ty(Ctx), llvm::Type::getInt64PtrTy(Ctx),
+        llvm::Type::getInt64Ty(Ctx)};
+    llvm::FunctionType *input_dep_type = llvm::FunctionType::get(
+        llvm::Type::getVoidTy(Ctx), input_dep_params, false);
+    inputDepLogger = M.getOrInsertFunction("oh_input_dep_log", input_dep_type);
+    if (auto *F = llvm::dyn_cast<llvm::Function>(inputDepLogger)) {
+      if (RuntimeAttributes) {
+        add_logger_attributes(F);
+      }
+    }
+    runtimeFunctions.insert(inputDepLogger);
+  }
+  if (Profile) {
+    setup_profiling(M);
+  }
 }
 
 void ObliviousHashInsertionPass::setup_hash_values(llvm::Module &M) {
   llvm::LLVMContext &Ctx = M.getContext();
+  const auto tls_mode = ThreadLocalHashes
+                           ? llvm::GlobalValue::InitialExecTLSModel
+                           : llvm::GlobalValue::NotThreadLocal;
+  // the hash variables are only reachable through the calls they are passed
+  // to, internal linkage lets the optimizer rely on that
   for (int i = 0; i < num_hash; i++) {
     hashPtrs.push_back(new llvm::GlobalVariable(
         M, llvm::Type::getInt64Ty(Ctx), false,
-        llvm::GlobalValue::ExternalLinkage,
-        llvm::ConstantInt::get(llvm::Type::getInt64Ty(Ctx), 0)));
+        llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantInt::get(llvm::Type::getInt64Ty(Ctx), 0), "", nullptr,
+        tls_mode));
+  }
+}
+
+bool ObliviousHashInsertionPass::is_skipped(const llvm::Instruction &I) const {
+  if (!hasTagsToSkip || !I.hasMetadataOtherThanDebugLoc()) {
+    return false;
+  }
+  for (unsigned kind : skipTagKinds) {
+    if (I.getMetadata(kind) != nullptr) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ObliviousHashInsertionPass::get_verdicts(
+    llvm::Function &F, InputDependencyVerdicts &verdicts) {
+  if (ReuseInputDependency) {
+    // the metadata must describe this very function
+    return read_verdicts(F, verdicts) &&
+           (!verdicts.input_independent ||
+            (verdicts.dependent_instructions.size() ==
+                 static_cast<unsigned>(std::distance(llvm::inst_begin(F),
+                                                     llvm::inst_end(F))) &&
+             verdicts.nondeterministic_blocks.size() == F.size()));
+  }
+  const auto &function_calls =
+      getAnalysis<input_dependency::InputDependentFunctionsPass>();
+  verdicts.input_independent = function_calls.is_function_input_independent(&F);
+  if (!verdicts.input_independent) {
+    return true;
+  }
+  const auto &input_dependency_info =
+      getAnalysis<input_dependency::InputDependencyAnalysis>();
+  const auto &non_det_blocks =
+      getAnalysis<NonDeterministicBasicBlocksAnalysis>();
+  for (auto &B : F) {
+    verdicts.nondeterministic_blocks.push_back(
+        non_det_blocks.is_block_nondeterministic(&B));
+    for (auto &I : B) {
+      verdicts.dependent_instructions.push_back(
+          input_dependency_info.isInputDependent(&I));
+    }
+  }
+  return true;
+}
+
+void ObliviousHashInsertionPass::plan_function(
+    llvm::Function &F, const llvm::LoopInfo &LI, bool is_assert_function,
+    const InputDependencyVerdicts &verdicts, FunctionPlan &plan) {
+  for (auto &I : llvm::instructions(F)) {
+    plan.instructions.push_back(&I);
+  }
+  plan.input_dependent = verdicts.dependent_instructions;
+  plan.hashes.resize(plan.instructions.size());
+  plan.loggers.resize(plan.instructions.size());
+  // ordinals of the original instructions identify profiled sites across
+  // builds
+  instructionOrdinals.clear();
+  if (Profile || !ProfileUse.empty()) {
+    for (unsigned ordinal = 0; ordinal < plan.instructions.size(); ++ordinal) {
+      instructionOrdinals[plan.instructions[ordinal]] = ordinal;
+    }
+  }
+  if (!is_assert_function) {
+    llvm::dbgs() << "InsertLogger skipped function:" << F.getName()
+                 << " because it is not in the assert list!\n";
+  }
+
+  unsigned ordinal = 0;
+  unsigned position = 0;
+  for (auto &B : F) {
+    plan.block_ordinals[&B] = ordinal;
+    if (verdicts.nondeterministic_blocks.test(position++)) {
+      plan.nondeterministic_blocks.insert(&B);
+      if (&F.back() != &B) {
+        ordinal += B.size();
+        continue;
+      }
+    }
+    const bool in_loop = LI.getLoopFor(&B) != nullptr;
+    if (is_assert_function && !in_loop) {
+      plan.check_blocks.insert(&B);
+    }
+    for (auto &I : B) {
+      const unsigned site = ordinal++;
+      if (llvm::isa<llvm::PHINode>(I)) {
+        continue;
+      }
+      if (auto *callInst = llvm::dyn_cast<llvm::CallInst>(&I)) {
+        auto *calledF = callInst->getCalledFunction();
+        if (calledF && is_runtime_function(calledF)) {
+          continue;
+        }
+      }
+      if (is_hashed_instruction(I) && !plan.input_dependent.test(site)) {
+        // skip instrumenting instructions whose tag matches the skip tag list
+        if (is_skipped(I)) {
+          llvm::dbgs() << "Skipping tagged instruction: ";
+          I.print(llvm::dbgs(), true);
+          llvm::dbgs() << "\n";
+        } else if (!is_hot_site(ProfileSites::Hash, I)) {
+          plan.hashes.set(site);
+        }
+      }
+      if (Placement == RandomPlacement && is_assert_function && !in_loop) {
+        plan.loggers.set(site);
+      }
+    }
+  }
+  if (!LoopSummary) {
+    return;
+  }
+  // the outermost deterministic loops are summarized, with their nested
+  // loops
+  auto &SE = getAnalysis<llvm::ScalarEvolutionWrapperPass>(F).getSE();
+  std::vector<llvm::Loop *> loops(LI.begin(), LI.end());
+  while (!loops.empty()) {
+    llvm::Loop *L = loops.back();
+    loops.pop_back();
+    if (!is_summarizable(L, SE, plan)) {
+      loops.insert(loops.end(), L->begin(), L->end());
+      continue;
+    }
+    plan.summaries.push_back(L);
+    for (auto *B : L->blocks()) {
+      const unsigned begin = plan.block_ordinals[B];
+      plan.hashes.reset(begin, begin + B->size());
+    }
+  }
+}
+
+bool ObliviousHashInsertionPass::is_summarizable(
+    llvm::Loop *L, llvm::ScalarEvolution &SE, const FunctionPlan &plan) const {
+  llvm::BasicBlock *exit = L->getUniqueExitBlock();
+  if (exit == nullptr || !L->hasDedicatedExits() ||
+      plan.nondeterministic_blocks.count(exit) ||
+      llvm::isa<llvm::SCEVCouldNotCompute>(SE.getBackedgeTakenCount(L))) {
+    return false;
+  }
+  // control flow, loop carried values, hashed values and results used after
+  // the loop must not depend on input
+  for (auto *B : L->blocks()) {
+    if (plan.nondeterministic_blocks.count(B)) {
+      return false;
+    }
+    unsigned ordinal = plan.block_ordinals.at(B);
+    for (auto &I : *B) {
+      const bool is_summarized = I.isTerminator() ||
+                                 llvm::isa<llvm::PHINode>(I) ||
+                                 is_hashed_instruction(I) || is_live_out(I, L);
+      if (is_summarized && plan.input_dependent.test(ordinal)) {
+        return false;
+      }
+      ++ordinal;
+    }
+  }
+  return true;
+}
+
+void ObliviousHashInsertionPass::summarize_loop(llvm::Loop *L,
+                                                llvm::ScalarEvolution &SE,
+                                                const llvm::DominatorTree &DT,
+                                                BlockHashes &block_hashes) {
+  llvm::BasicBlock *exit = L->getUniqueExitBlock();
+  llvm::Instruction *position = &*exit->getFirstInsertionPt();
+  llvm::Instruction *owner = owning_instruction(*position);
+  llvm::SCEVExpander expander(SE, exit->getModule()->getDataLayout(),
+                              "oh.summary");
+  auto expand = [&](const llvm::SCEV *S) -> llvm::Value * {
+    if (llvm::isa<llvm::SCEVCouldNotCompute>(S) || !SE.isLoopInvariant(S, L) ||
+        !llvm::isSafeToExpand(S, SE)) {
+      return nullptr;
+    }
+    return expander.expandCodeFor(S, S->getType(), position);
+  };
+
+  std::vector<llvm::Value *> values;
+  if (auto *trip_count = expand(SE.getBackedgeTakenCount(L))) {
+    values.push_back(trip_count);
+  }
+  // loop carried values, by their closed form on exit when SCEV has one
+  for (auto &I : *L->getHeader()) {
+    auto *phi = llvm::dyn_cast<llvm::PHINode>(&I);
+    if (phi == nullptr) {
+      break;
+    }
+    if (!is_summary_type(phi->getType())) {
+      continue;
+    }
+    llvm::Value *exit_value = nullptr;
+    if (SE.isSCEVable(phi->getType())) {
+      exit_value = expand(SE.getSCEVAtScope(phi, L->getParentLoop()));
+    }
+    values.push_back(exit_value != nullptr ? exit_value : phi);
+  }
+  for (auto *B : L->blocks()) {
+    if (!DT.dominates(B, exit)) {
+      continue;
+    }
+    for (auto &I : *B) {
+      if (is_summary_type(I.getType()) && is_live_out(I, L) &&
+          !(B == L->getHeader() && llvm::isa<llvm::PHINode>(I))) {
+        values.push_back(&I);
+      }
+    }
+  }
+
+  llvm::IRBuilder<> builder(position);
+  const size_t used_hashes = usedHashIndices.size();
+  for (auto *value : values) {
+    insertHashBuilder(builder, value, owner);
+  }
+  auto &indices = block_hashes[exit];
+  indices.insert(indices.end(), usedHashIndices.begin() + used_hashes,
+                 usedHashIndices.end());
+  llvm::dbgs() << "Loop " << L->getHeader()->getName() << " summarized by "
+               << values.size() << " values at its exit\n";
+}
+
+bool ObliviousHashInsertionPass::apply_plan(llvm::Function &F,
+                                            const llvm::LoopInfo &LI,
+                                            const FunctionPlan &plan) {
+  bool modified = false;
+  BlockHashes block_hashes;
+  if (!plan.summaries.empty()) {
+    auto &SE = getAnalysis<llvm::ScalarEvolutionWrapperPass>(F).getSE();
+    auto &DT = getAnalysis<llvm::DominatorTreeWrapperPass>(F).getDomTree();
+    for (auto *L : plan.summaries) {
+      summarize_loop(L, SE, DT, block_hashes);
+    }
+    modified = true;
+  }
+  // inserted instructions are not in the plan, so instrumenting a site does
+  // not move the ones after it
+  llvm::BitVector sites = plan.hashes;
+  sites |= plan.loggers;
+  for (int site = sites.find_first(); site != -1;
+       site = sites.find_next(site)) {
+    llvm::Instruction &I = *plan.instructions[site];
+    if (plan.hashes.test(site)) {
+      const size_t used_hashes = usedHashIndices.size();
+      instrumentInst(I);
+      if (used_hashes != usedHashIndices.size()) {
+        auto &indices = block_hashes[I.getParent()];
+        indices.insert(indices.end(), usedHashIndices.begin() + used_hashes,
+                       usedHashIndices.end());
+      }
+      modified = true;
+    }
+    if (plan.loggers.test(site)) {
+      insertLogger(I);
+      modified = true;
+    }
+  }
+  if (Placement == DominancePlacement) {
+    modified |= place_loggers(F, LI, block_hashes, plan.check_blocks);
+  }
+  return modified;
+}
+
+// the code running before main keeps the hash variables at 0 if no
+// constructor hashes or calls a function of the module, directly or through
+// external code
+bool ObliviousHashInsertionPass::ctors_keep_hashes(const llvm::Module &M,
+                                                   bool callbacks) const {
+  for (auto *ctor : get_structors(M, "llvm.global_ctors")) {
+    for (const auto &I : llvm::instructions(ctor)) {
+      if (llvm::isa<llvm::InvokeInst>(I)) {
+        return false;
+      }
+      auto *call = llvm::dyn_cast<llvm::CallInst>(&I);
+      if (call == nullptr) {
+        continue;
+      }
+      auto *callee = call->getCalledFunction();
+      if (callee == nullptr || is_hash_function(callee) ||
+          (!callee->isIntrinsic() && (!callee->isDeclaration() || callbacks))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Hash variables start at 0 and only the module updates them, so along the
+// straight-line path from the entry of main, up to the first call that may
+// reach instrumented code, the hashes are known at compile time as long as
+// every hashed value folds to a constant. Loggers of known hashes become
+// oh_input_dep_log(id, hashVar, expected), which -insert-asserts-finalize
+// turns into assertions without training. The path follows branches on
+// constant conditions into blocks without other predecessors, so every
+// logger on it runs once per execution.
+unsigned
+ObliviousHashInsertionPass::precompute_constant_sites(llvm::Module &M) {
+  llvm::Function *main = M.getFunction("main");
+  if (main == nullptr || main->isDeclaration() || !main->use_empty()) {
+    return 0;
+  }
+  const bool callbacks = has_callbacks(M);
+  if (!ctors_keep_hashes(M, callbacks)) {
+    llvm::dbgs() << "Constructors may update the hashes before main, no "
+                    "sites are precomputed\n";
+    return 0;
+  }
+  const llvm::DataLayout &DL = M.getDataLayout();
+  // hash variables with a known value
+  std::unordered_map<llvm::Value *, uint64_t> hash_values;
+  for (auto *hash_ptr : hashPtrs) {
+    hash_values[hash_ptr] = 0;
+  }
+  std::unordered_map<llvm::Value *, llvm::Constant *> values;
+  // constants last stored to allocas
+  std::unordered_map<llvm::Value *, llvm::Constant *> memory;
+  std::vector<std::pair<llvm::CallInst *, uint64_t>> sites;
+  auto get_constant = [&values](llvm::Value *v) -> llvm::Constant * {
+    if (auto *C = llvm::dyn_cast<llvm::Constant>(v)) {
+      return C;
+    }
+    auto value = values.find(v);
+    return value != values.end() ? value->second : nullptr;
+  };
+
+  llvm::BasicBlock *prev = nullptr;
+  llvm::BasicBlock *B = &main->getEntryBlock();
+  bool stop = false;
+  while (B != nullptr && !stop) {
+    for (auto &I : *B) {
+      if (I.isTerminator()) {
+        break;
+      }
+      llvm::Constant *result = nullptr;
+      if (auto *phi = llvm::dyn_cast<llvm::PHINode>(&I)) {
+        result = get_constant(phi->getIncomingValueForBlock(prev));
+      } else if (auto *call = llvm::dyn_cast<llvm::CallInst>(&I)) {
+        auto *callee = call->getCalledFunction();
+        auto kernel = hashKernels.find(callee);
+        if (kernel != hashKernels.end()) {
+          auto hash = hash_values.find(call->getArgOperand(0));
+          if (hash == hash_values.end()) {
+            continue;
+          }
+          llvm::Constant *value = get_constant(call->getArgOperand(1));
+          if (auto *int_value =
+                  llvm::dyn_cast_or_null<llvm::ConstantInt>(value)) {
+            hash->second = kernel->second.hash(
+                hash->second, int_value->getZExtValue(), kernel->second.bytes);
+          } else if (auto *fp_value =
+                         llvm::dyn_cast_or_null<llvm::ConstantFP>(value)) {
+            hash->second = kernel->second.hash(
+                hash->second,
+                fp_value->getValueAPF().bitcastToAPInt().getZExtValue(),
+                kernel->second.bytes);
+          } else {
+            hash_values.erase(hash);
+          }
+        } else if (HashFamilyOpt == AssocFamily && callee == assocTerm) {
+          auto *key = llvm::dyn_cast_or_null<llvm::ConstantInt>(
+              get_constant(call->getArgOperand(0)));
+          auto *value = llvm::dyn_cast_or_null<llvm::ConstantInt>(
+              get_constant(call->getArgOperand(1)));
+          if (key != nullptr && value != nullptr) {
+            result = llvm::ConstantInt::get(
+                call->getType(), oh_hash_assoc_term(key->getZExtValue(),
+                                                    value->getZExtValue()));
+          }
+        } else if (callee == logger) {
+          auto hash = hash_values.find(call->getArgOperand(1));
+          if (hash != hash_values.end()) {
+            sites.emplace_back(call, hash->second);
+          }
+        } else if (callee != nullptr &&
+                   (callee->isIntrinsic() || is_runtime_function(callee) ||
+                    (callee->isDeclaration() && !callbacks))) {
+          // external code may write the allocas whose address escaped
+          if (call->mayWriteToMemory()) {
+            memory.clear();
+          }
+        } else {
+          stop = true;
+          break;
+        }
+      } else if (auto *store = llvm::dyn_cast<llvm::StoreInst>(&I)) {
+        llvm::Value *ptr = store->getPointerOperand();
+        llvm::Constant *value = get_constant(store->getValueOperand());
+        auto *int_value = llvm::dyn_cast_or_null<llvm::ConstantInt>(value);
+        if (is_hash_variable(ptr)) {
+          // inline updates of -oh-hash-family=assoc
+          if (int_value != nullptr) {
+            hash_values[ptr] = int_value->getZExtValue();
+          } else {
+            hash_values.erase(ptr);
+          }
+        } else if (!store->isUnordered() ||
+                   !llvm::isa<llvm::AllocaInst>(ptr)) {
+          memory.clear();
+        } else if (value != nullptr) {
+          memory[ptr] = value;
+        } else {
+          memory.erase(ptr);
+        }
+      } else if (auto *load = llvm::dyn_cast<llvm::LoadInst>(&I)) {
+        llvm::Value *ptr = load->getPointerOperand();
+        auto hash = hash_values.find(ptr);
+        if (!load->isUnordered()) {
+          // volatile and atomic loads are not folded
+        } else if (hash != hash_values.end()) {
+          result = llvm::ConstantInt::get(load->getType(), hash->second);
+        } else if (llvm::isa<llvm::AllocaInst>(ptr)) {
+          auto stored = memory.find(ptr);
+          if (stored != memory.end() &&
+              stored->second->getType() == load->getType()) {
+            result = stored->second;
+          }
+        } else if (auto *C = llvm::dyn_cast<llvm::Constant>(ptr)) {
+          result = llvm::ConstantFoldLoadFromConstPtr(C, load->getType(), DL);
+        }
+      } else if (I.mayReadOrWriteMemory() || llvm::isa<llvm::AllocaInst>(I)) {
+        if (I.mayWriteToMemory()) {
+          memory.clear();
+        }
+      } else {
+        std::vector<llvm::Constant *> operands;
+        for (auto &operand : I.operands()) {
+          if (auto *C = get_constant(operand.get())) {
+            operands.push_back(C);
+          }
+        }
+        if (operands.size() == I.getNumOperands()) {
+          if (auto *cmp = llvm::dyn_cast<llvm::CmpInst>(&I)) {
+            result = llvm::ConstantFoldCompareInstOperands(
+                cmp->getPredicate(), operands[0], operands[1], DL);
+          } else {
+            result = llvm::ConstantFoldInstOperands(&I, operands, DL);
+          }
+        }
+      }
+      if (result != nullptr) {
+        values[&I] = result;
+      }
+    }
+    if (stop) {
+      break;
+    }
+    llvm::BasicBlock *next = nullptr;
+    if (auto *br = llvm::dyn_cast<llvm::BranchInst>(B->getTerminator())) {
+      if (br->isUnconditional()) {
+        next = br->getSuccessor(0);
+      } else if (auto *condition = llvm::dyn_cast_or_null<llvm::ConstantInt>(
+                     get_constant(br->getCondition()))) {
+        next = br->getSuccessor(condition->isZero() ? 1 : 0);
+      }
+    }
+    if (next != nullptr && next->getSinglePredecessor() != B) {
+      next = nullptr;
+    }
+    prev = B;
+    B = next;
+  }
+
+  for (const auto &site : sites) {
+    llvm::CallInst *log_call = site.first;
+    llvm::IRBuilder<> builder(log_call);
+    auto *call = builder.CreateCall(
+        inputDepLogger, {log_call->getArgOperand(0), log_call->getArgOperand(1),
+                         builder.getInt64(site.second)});
+    if (RuntimeAttributes) {
+      add_logger_attributes(call);
+    }
+    log_call->eraseFromParent();
+  }
+  llvm::dbgs() << "Precomputed the hashes of " << sites.size()
+               << " loggers in main\n";
+  return sites.size();
+}
+
+void ObliviousHashInsertionPass::dump_plan(const llvm::Function &F,
+                                           const FunctionPlan &plan) const {
+  llvm::dbgs() << "Plan of " << F.getName() << ": "
+               << plan.instructions.size() << " instructions, "
+               << plan.hashes.count() << " hashed, " << plan.loggers.count()
+               << " logger positions, " << plan.check_blocks.size()
+               << " check blocks, " << plan.summaries.size()
+               << " summarized loops\n";
+  for (unsigned site = 0; site < plan.instructions.size(); ++site) {
+    llvm::dbgs() << (plan.hashes.test(site) ? "H" : "-")
+                 << (plan.loggers.test(site) ? "L" : "-") << " " << site
+                 << *plan.instructions[site] << "\n";
   }
 }
 
 bool ObliviousHashInsertionPass::runOnModule(llvm::Module &M) {
   parse_skip_tags();
+  for (const auto &tag : skipTags) {
+    skipTagKinds.push_back(M.getContext().getMDKindID(tag));
+  }
   llvm::dbgs() << "Insert hash computation\n";
   bool modified = false;
   unique_id_generator::get().reset();
   srand(time(NULL));
 
   hashPtrs.reserve(num_hash);
-  const auto &input_dependency_info =
-      getAnalysis<input_dependency::InputDependencyAnalysis>();
-  const auto &function_calls =
-      getAnalysis<input_dependency::InputDependentFunctionsPass>();
-  const auto &non_det_blocks =
-      getAnalysis<NonDeterministicBasicBlocksAnalysis>();
+  // the annotated copy is taken before anything is instrumented
+  std::unique_ptr<llvm::Module> annotated;
+  llvm::ValueToValueMapTy annotated_values;
+  if (!SaveInputDependency.empty()) {
+    annotated = llvm::CloneModule(&M, annotated_values);
+  }
   const auto &assert_function_info =
       getAnalysis<AssertFunctionMarkPass>().get_assert_functions_info();
+  if (!ProfileUse.empty() &&
+      profileSites.read_profile(ProfileMap, ProfileUse, ProfileHotFraction)) {
+    llvm::dbgs() << profileSites.hot_sites_count()
+                 << " hot sites are not instrumented\n";
+  }
   // Get the function to call from our runtime library.
   setup_functions(M);
   // Insert Globals
@@ -327,88 +1563,93 @@ bool ObliviousHashInsertionPass::runOnModule(llvm::Module &M) {
       continue;
     }
     llvm::dbgs()<<" Processing function:"<<F.getName()<<"\n";
+    InputDependencyVerdicts verdicts;
+    if (!get_verdicts(F, verdicts)) {
+      llvm::errs() << "ERR. no input dependency metadata for " << F.getName()
+                   << ", run without -oh-reuse-input-dependency\n";
+      exit(1);
+    }
+    if (annotated) {
+      write_verdicts(*llvm::cast<llvm::Function>(annotated_values[&F]),
+                     verdicts);
+    }
     // no hashes for functions called from non deterministc blocks
-    if (!function_calls.is_function_input_independent(&F)) {
+    if (!verdicts.input_independent) {
       continue;
     }
     llvm::LoopInfo &LI =
         getAnalysis<llvm::LoopInfoWrapperPass>(F).getLoopInfo();
-    for (auto &B : F) {
-      if (non_det_blocks.is_block_nondeterministic(&B) && &F.back() != &B) {
-        continue;
-      }
-      for (auto &I : B) {
-        if (auto phi = llvm::dyn_cast<llvm::PHINode>(&I)) {
-          continue;
-        }
-        if (auto callInst = llvm::dyn_cast<llvm::CallInst>(&I)) {
-          auto calledF = callInst->getCalledFunction();
-          if (calledF && calledF->getName() == "oh_log") {
-            continue;
-          }
-        }
-        if (input_dependency_info.isInputDependent(&I)) {
-           /*if (auto callInst = llvm::dyn_cast<llvm::CallInst>(&I)) {
-		llvm::dbgs()<<"Input dependent call instruction: ";
-		callInst->print(llvm::dbgs(),true);
-                llvm::dbgs()<<"\n";
-           }*/
-           //llvm::dbgs() << "D: " << I << "\n";
-        } else {
-          // llvm::dbgs() << "I: " << I << "\n";
-	   /*if (auto callInst = llvm::dyn_cast<llvm::CallInst>(&I)) {
-		llvm::dbgs()<<"Input independent call instruction: ";
-		callInst->print(llvm::dbgs(),true);
-                llvm::dbgs()<<"\n";
-           }*/
-          //skip instrumenting instructions whose tag matches the skip tag list 
-          if(this->hasTagsToSkip && I.hasMetadataOtherThanDebugLoc()){
-            llvm::dbgs()<<"Found instruction with tags ad we have set tags\n";
-            for(auto tag: skipTags){
-              llvm::dbgs()<<tag<<"\n";
-              if (auto *metadata = I.getMetadata(tag)) {
-                llvm::dbgs()<<"Skipping tagged instruction: ";
-                I.print(llvm::dbgs(),true);
-                llvm::dbgs()<<"\n";
-                continue;
-              }
-            }
-          }
-
-          instrumentInst(I);
-          modified = true;
-        }
-        auto loop = LI.getLoopFor(&B);
-        if (loop != nullptr) {
-          continue;
-        }
-        // Filter assert functions, unless there is no assert function
-        // specified,
-        // in which case all functions are good to go
-        if (assert_function_info.get_assert_functions().size() == 0 ||
-            assert_function_info.is_assert_function(&F)) {
-          insertLogger(I);
-          modified = true;
-        } else {
-          llvm::dbgs() << "InsertLogger skipped function:" << F.getName()
-                       << " because it is not in the assert list!\n";
-        }
-      }
+    // Filter assert functions, unless there is no assert function
+    // specified,
+    // in which case all functions are good to go
+    const bool is_assert_function =
+        assert_function_info.get_assert_functions().size() == 0 ||
+        assert_function_info.is_assert_function(&F);
+    blockLoggers.clear();
+    functionLoggers = 0;
+    FunctionPlan plan;
+    plan_function(F, LI, is_assert_function, verdicts, plan);
+    if (DumpPlan) {
+      dump_plan(F, plan);
+    }
+    modified |= apply_plan(F, LI, plan);
+  }
+  if (PrecomputeConstants) {
+    precompute_constant_sites(M);
+  }
+  if (Profile) {
+    finish_profiling(M);
+  }
+  if (annotated) {
+    std::error_code EC;
+    llvm::raw_fd_ostream annotated_file(SaveInputDependency, EC,
+                                        llvm::sys::fs::F_None);
+    if (EC) {
+      llvm::errs() << "ERR. cannot write " << SaveInputDependency << ": "
+                   << EC.message() << "\n";
+    } else {
+      llvm::WriteBitcodeToFile(annotated.get(), annotated_file);
     }
   }
   return modified;
 }
 
+bool ObliviousHashInsertionPass::inserts_late() {
+  return InsertionPointOpt == LateInsertion;
+}
+
+bool ObliviousHashInsertionPass::uses_thread_local_hashes() {
+  return ThreadLocalHashes;
+}
+
 static llvm::RegisterPass<ObliviousHashInsertionPass>
     X("oh-insert", "Instruments bitcode with hashing and logging functions");
 
+// the option is read when the pipeline is built, so both extension points
+// are registered and the one not selected adds nothing
 static void registerPathsAnalysisPass(const llvm::PassManagerBuilder &,
                                       llvm::legacy::PassManagerBase &PM) {
+  if (InsertionPointOpt == EarlyInsertion) {
+    PM.add(new ObliviousHashInsertionPass());
+  }
+}
 
-  PM.add(new ObliviousHashInsertionPass());
+static void registerLateInsertionPass(const llvm::PassManagerBuilder &,
+                                      llvm::legacy::PassManagerBase &PM) {
+  if (InsertionPointOpt == LateInsertion) {
+    PM.add(new ObliviousHashInsertionPass());
+  }
 }
 
 static llvm::RegisterStandardPasses
     RegisterMyPass(llvm::PassManagerBuilder::EP_EarlyAsPossible,
                    registerPathsAnalysisPass);
+
+static llvm::RegisterStandardPasses
+    RegisterLatePass(llvm::PassManagerBuilder::EP_OptimizerLast,
+                     registerLateInsertionPass);
+
+static llvm::RegisterStandardPasses
+    RegisterLatePassO0(llvm::PassManagerBuilder::EP_EnabledOnOptLevel0,
+                       registerLateInsertionPass);
 }
@@ -1,9 +1,23 @@
 #pragma once
 
+#include "InputDependencyVerdicts.h"
+#include "ProfileSites.h"
+
+#include "llvm/ADT/BitVector.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Pass.h"
 
+#include <unordered_map>
+#include <unordered_set>
+
+namespace llvm {
+class DominatorTree;
+class Loop;
+class LoopInfo;
+class ScalarEvolution;
+}
+
 namespace oh {
 
 class ObliviousHashInsertionPass : public llvm::ModulePass {
@@ -15,24 +29,127 @@ public:
   bool runOnModule(llvm::Module &M) override;
   virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const override;
 
+  // whether the standard pipeline runs the pass after its optimizations
+  // (-oh-insertion-point=late) instead of before them
+  static bool inserts_late();
+  // whether the hash variables are thread local (-oh-thread-local-hashes)
+  static bool uses_thread_local_hashes();
+
+private:
+  // width specialized entry points of one hash function, see hashes/hash.c
+  struct HashFunctions {
+    llvm::Constant *i8;
+    llvm::Constant *i16;
+    llvm::Constant *i32;
+    llvm::Constant *i64;
+    llvm::Constant *f32;
+    llvm::Constant *f64;
+  };
+
+  // byte wise hash of hashes/hash_kernels.h an entry point computes, and the
+  // size of its value
+  struct HashKernel {
+    using hash_type = uint64_t (*)(uint64_t hash, uint64_t value,
+                                   unsigned bytes);
+    hash_type hash;
+    unsigned bytes;
+  };
+
+  // indices of the hash variables updated in a block
+  using BlockHashes =
+      std::unordered_map<llvm::BasicBlock *, std::vector<unsigned>>;
+
+  // sites chosen in a function before it is instrumented. Instructions are
+  // the original instructions of the function, the position of an
+  // instruction is its ordinal and indexes the bit vectors.
+  struct FunctionPlan {
+    std::vector<llvm::Instruction *> instructions;
+    // instructions whose value is hashed
+    llvm::BitVector hashes;
+    // instructions a logger may be inserted before (random placement)
+    llvm::BitVector loggers;
+    // blocks loggers may be placed in (dominance placement)
+    std::unordered_set<llvm::BasicBlock *> check_blocks;
+    // ordinal of the first instruction of every block
+    std::unordered_map<llvm::BasicBlock *, unsigned> block_ordinals;
+    // input dependent instructions by ordinal and non deterministic blocks
+    llvm::BitVector input_dependent;
+    std::unordered_set<llvm::BasicBlock *> nondeterministic_blocks;
+    // deterministic loops hashed once at their exit (-oh-loop-summary), the
+    // instructions in them are not hashed
+    std::vector<llvm::Loop *> summaries;
+  };
+
 private:
   void setup_functions(llvm::Module &M);
+  void setup_hash_functions(llvm::Module &M, const std::string &name,
+                            HashKernel::hash_type kernel,
+                            HashFunctions &functions);
+  bool is_hash_function(llvm::Function *F) const;
+  bool is_runtime_function(llvm::Function *F) const;
+  bool is_hash_variable(llvm::Value *v) const;
   void setup_hash_values(llvm::Module &M);
-  bool insertHashBuilder(llvm::IRBuilder<> &builder, llvm::Value *v);
+  bool insertHashBuilder(llvm::IRBuilder<> &builder, llvm::Value *v,
+                         llvm::Instruction *owner);
   void insertHash(llvm::Instruction &I, llvm::Value *v, bool before);
+  void insert_assoc_update(llvm::IRBuilder<> &builder, llvm::Value *hash_ptr,
+                           llvm::Value *value);
   bool instrumentInst(llvm::Instruction &I);
   void insertLogger(llvm::Instruction &I);
   void insertLogger(llvm::IRBuilder<> &builder, llvm::Instruction &I,
                     unsigned hashToLogIdx);
+  bool place_loggers(llvm::Function &F, const llvm::LoopInfo &LI,
+                     const BlockHashes &block_hashes,
+                     const std::unordered_set<llvm::BasicBlock *> &check_blocks);
   void end_logging(llvm::Instruction &I);
+  void setup_profiling(llvm::Module &M);
+  void finish_profiling(llvm::Module &M);
+  llvm::Value *insert_profile_begin(llvm::IRBuilder<> &builder,
+                                    ProfileSites::Kind kind,
+                                    llvm::Instruction *owner);
+  void insert_profile_end(llvm::IRBuilder<> &builder, llvm::Value *start);
+  bool is_hot_site(ProfileSites::Kind kind, llvm::Instruction &I) const;
+  llvm::Instruction *owning_instruction(llvm::Instruction &I) const;
   void parse_skip_tags();
+  bool is_skipped(const llvm::Instruction &I) const;
+  bool get_verdicts(llvm::Function &F, InputDependencyVerdicts &verdicts);
+  void plan_function(llvm::Function &F, const llvm::LoopInfo &LI,
+                     bool is_assert_function,
+                     const InputDependencyVerdicts &verdicts,
+                     FunctionPlan &plan);
+  bool apply_plan(llvm::Function &F, const llvm::LoopInfo &LI,
+                  const FunctionPlan &plan);
+  void dump_plan(const llvm::Function &F, const FunctionPlan &plan) const;
+  bool is_summarizable(llvm::Loop *L, llvm::ScalarEvolution &SE,
+                       const FunctionPlan &plan) const;
+  void summarize_loop(llvm::Loop *L, llvm::ScalarEvolution &SE,
+                      const llvm::DominatorTree &DT, BlockHashes &block_hashes);
+  bool ctors_keep_hashes(const llvm::Module &M, bool callbacks) const;
+  unsigned precompute_constant_sites(llvm::Module &M);
 private:
   bool hasTagsToSkip;
   std::vector<std::string> skipTags;
-  llvm::Constant *hashFunc1;
-  llvm::Constant *hashFunc2;
+  // metadata kinds of skipTags
+  std::vector<unsigned> skipTagKinds;
+  HashFunctions hashFuncs1;
+  HashFunctions hashFuncs2;
+  std::unordered_set<llvm::Value *> hashFunctions;
+  std::unordered_map<llvm::Value *, HashKernel> hashKernels;
+  // hash_assoc_term, the term of -oh-hash-family=assoc updates
+  llvm::Constant *assocTerm;
+  // hash functions, logger and profiling hooks
+  std::unordered_set<llvm::Value *> runtimeFunctions;
   llvm::Constant *logger;
+  // oh_input_dep_log, logger of sites precomputed at compile time
+  llvm::Constant *inputDepLogger;
   std::vector<llvm::GlobalVariable *> hashPtrs;
   std::vector<unsigned> usedHashIndices;
+  // loggers inserted in the function being instrumented
+  std::unordered_map<llvm::BasicBlock *, unsigned> blockLoggers;
+  unsigned functionLoggers;
+  llvm::Constant *profileBegin;
+  llvm::Constant *profileEnd;
+  ProfileSites profileSites;
+  std::unordered_map<llvm::Instruction *, unsigned> instructionOrdinals;
 };
 }
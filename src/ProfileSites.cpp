@@ -0,0 +1,113 @@
+#include "ProfileSites.h"
+
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+
+namespace oh {
+
+namespace {
+
+const char *kind_name(ProfileSites::Kind kind) {
+  return kind == ProfileSites::Hash ? "hash" : "log";
+}
+
+std::string get_location(const llvm::Instruction &I) {
+  const llvm::DebugLoc &loc = I.getDebugLoc();
+  if (!loc) {
+    return "-";
+  }
+  std::string location;
+  llvm::raw_string_ostream location_strm(location);
+  location_strm << loc->getFilename() << ":" << loc.getLine() << ":"
+                << loc.getCol();
+  return location_strm.str();
+}
+}
+
+unsigned ProfileSites::add_site(Kind kind, const llvm::Instruction &I,
+                                unsigned ordinal) {
+  m_sites.push_back(
+      Site{kind, I.getFunction()->getName().str(), ordinal, get_location(I)});
+  return m_sites.size() - 1;
+}
+
+// one site per line: id kind function ordinal location
+bool ProfileSites::write_map(const std::string &file_name) const {
+  std::ofstream map_strm(file_name);
+  if (!map_strm.is_open()) {
+    llvm::errs() << "ERR. cannot write profile map " << file_name << "\n";
+    return false;
+  }
+  for (unsigned id = 0; id < m_sites.size(); ++id) {
+    const auto &site = m_sites[id];
+    map_strm << id << " " << kind_name(site.kind) << " " << site.function
+             << " " << site.ordinal << " " << site.location << "\n";
+  }
+  return true;
+}
+
+bool ProfileSites::read_profile(const std::string &map_file,
+                                const std::string &profile_file,
+                                double hot_fraction) {
+  std::ifstream map_strm(map_file);
+  std::ifstream profile_strm(profile_file);
+  if (!map_strm.is_open() || !profile_strm.is_open()) {
+    llvm::errs() << "ERR. cannot read profile " << profile_file << " with map "
+                 << map_file << "\n";
+    return false;
+  }
+  std::unordered_map<unsigned, SiteKey> keys;
+  std::string line;
+  while (std::getline(map_strm, line)) {
+    std::istringstream line_strm(line);
+    unsigned id;
+    std::string kind;
+    std::string function;
+    unsigned ordinal;
+    if (line_strm >> id >> kind >> function >> ordinal) {
+      keys[id] = SiteKey(kind == "hash" ? Hash : Log, function, ordinal);
+    }
+  }
+
+  // hits of sites sharing a key are summed up
+  std::map<SiteKey, uint64_t> hits;
+  uint64_t total_hits[2] = {0, 0};
+  unsigned id;
+  uint64_t site_hits;
+  uint64_t cycles;
+  uint64_t samples;
+  while (profile_strm >> id >> site_hits >> cycles >> samples) {
+    auto key = keys.find(id);
+    if (key == keys.end()) {
+      llvm::dbgs() << "Profile site " << id << " is not in the map\n";
+      continue;
+    }
+    hits[key->second] += site_hits;
+    total_hits[std::get<0>(key->second)] += site_hits;
+  }
+  for (const auto &site : hits) {
+    const uint64_t total = total_hits[std::get<0>(site.first)];
+    if (total != 0 && site.second >= hot_fraction * total) {
+      m_hot_sites.insert(site.first);
+    }
+  }
+  return true;
+}
+
+bool ProfileSites::is_hot(Kind kind, const std::string &function,
+                          unsigned ordinal) const {
+  return m_hot_sites.find(SiteKey(kind, function, ordinal)) !=
+         m_hot_sites.end();
+}
+
+} // namespace oh
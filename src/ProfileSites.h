@@ -0,0 +1,54 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace llvm {
+class Instruction;
+}
+
+namespace oh {
+
+// Profiled hash update and logger sites of one build.
+// A site is identified across builds by its kind, the name of its function
+// and the ordinal of the original (not instrumented) instruction it was
+// inserted for. The map written by -oh-profile relates the profile site ids
+// used by the runtime (assertions/profile.cpp) to these keys.
+class ProfileSites {
+public:
+  enum Kind { Hash, Log };
+
+public:
+  ProfileSites() = default;
+  ProfileSites(const ProfileSites &) = delete;
+  ProfileSites &operator=(const ProfileSites &) = delete;
+
+public:
+  unsigned add_site(Kind kind, const llvm::Instruction &I, unsigned ordinal);
+  unsigned size() const { return m_sites.size(); }
+  bool write_map(const std::string &file_name) const;
+
+  // marks the sites of the profiled build that took at least hot_fraction
+  // of all hits of their kind as hot
+  bool read_profile(const std::string &map_file,
+                    const std::string &profile_file, double hot_fraction);
+  bool is_hot(Kind kind, const std::string &function, unsigned ordinal) const;
+  unsigned hot_sites_count() const { return m_hot_sites.size(); }
+
+private:
+  struct Site {
+    Kind kind;
+    std::string function;
+    unsigned ordinal;
+    std::string location;
+  };
+  using SiteKey = std::tuple<int, std::string, unsigned>;
+
+private:
+  std::vector<Site> m_sites;
+  std::set<SiteKey> m_hot_sites;
+}; // class ProfileSites
+
+} // namespace oh
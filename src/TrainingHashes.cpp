@@ -0,0 +1,102 @@
+#include "TrainingHashes.h"
+
+#include <algorithm>
+#include <fstream>
+#include <istream>
+#include <ostream>
+
+namespace oh {
+
+TrainingHashes &TrainingHashes::get(Stage stage) {
+  static TrainingHashes log_hashes;
+  static TrainingHashes dumper_hashes;
+  return stage == Log ? log_hashes : dumper_hashes;
+}
+
+// one "id hash" pair per line
+bool TrainingHashes::read_log(const std::string &file_name) {
+  std::ifstream hash_strm(file_name);
+  if (!hash_strm.good()) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_sites.clear();
+  m_saturated.clear();
+  std::string id_str;
+  std::string hash_str;
+  // the log may legitimately be empty when every site was saturated
+  while (hash_strm >> id_str >> hash_str) {
+    const unsigned id = std::stoi(id_str);
+    if (id >= m_sites.size()) {
+      m_sites.resize(id + 1);
+    }
+    m_sites[id].insert(std::stoull(hash_str));
+  }
+  return true;
+}
+
+void TrainingHashes::start_collecting(unsigned max_hashes) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_sites.clear();
+  m_saturated.clear();
+  m_max_hashes = max_hashes;
+  m_collected = true;
+}
+
+void TrainingHashes::add(unsigned id, uint64_t hash) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (id >= m_sites.size()) {
+    m_sites.resize(2 * (id + 1));
+    m_saturated.resize(m_sites.size(), false);
+  }
+  if (m_saturated[id]) {
+    return;
+  }
+  auto &site = m_sites[id];
+  site.insert(hash);
+  if (m_max_hashes != 0 && site.size() > m_max_hashes) {
+    m_saturated[id] = true;
+    site.clear();
+  }
+}
+
+unsigned TrainingHashes::get_saturated_count() const {
+  return std::count(m_saturated.begin(), m_saturated.end(), true);
+}
+
+// "id hash" per hash and "id saturated" per saturated site, up to "end"
+void TrainingHashes::write_state(std::ostream &strm) const {
+  for (unsigned id = 0; id < m_sites.size(); ++id) {
+    if (id < m_saturated.size() && m_saturated[id]) {
+      strm << id << " saturated\n";
+      continue;
+    }
+    for (const auto &hash : m_sites[id]) {
+      strm << id << " " << hash << "\n";
+    }
+  }
+  strm << "end\n";
+}
+
+bool TrainingHashes::read_state(std::istream &strm) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_sites.clear();
+  m_saturated.clear();
+  std::string id_str;
+  std::string hash_str;
+  while (strm >> id_str && id_str != "end" && strm >> hash_str) {
+    const unsigned id = std::stoi(id_str);
+    if (id >= m_sites.size()) {
+      m_sites.resize(id + 1);
+      m_saturated.resize(id + 1, false);
+    }
+    if (hash_str == "saturated") {
+      m_saturated[id] = true;
+    } else {
+      m_sites[id].insert(std::stoull(hash_str));
+    }
+  }
+  return id_str == "end";
+}
+
+} // namespace oh
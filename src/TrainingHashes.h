@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace oh {
+
+// Hashes observed per site while training a module.
+// The assertion passes read them from the logs written by the runtime
+// (hashes.log for oh_log, hashes_dumper.log for oh_assert_dumper), unless a
+// training run in the same process (tools/oh-jit-train) already collected
+// them in memory.
+class TrainingHashes {
+public:
+  using hash_value_set = std::unordered_set<uint64_t>;
+  enum Stage { Log, Dumper };
+
+public:
+  static TrainingHashes &get(Stage stage);
+
+  TrainingHashes(const TrainingHashes &) = delete;
+  TrainingHashes &operator=(const TrainingHashes &) = delete;
+
+public:
+  bool read_log(const std::string &file_name);
+  // drops the hashes collected so far. Sites seeing more than max_hashes
+  // distinct hashes get no hashes at all, 0 means no limit.
+  void start_collecting(unsigned max_hashes);
+  void add(unsigned id, uint64_t hash);
+
+  bool is_collected() const { return m_collected; }
+  const std::vector<hash_value_set> &get_sites() const { return m_sites; }
+  unsigned get_saturated_count() const;
+
+  // the collected hashes and saturated sites, e.g. of a training run in a
+  // child process. read_state replaces the collected hashes.
+  void write_state(std::ostream &strm) const;
+  bool read_state(std::istream &strm);
+
+private:
+  TrainingHashes() : m_max_hashes(0), m_collected(false) {}
+
+private:
+  std::mutex m_mutex;
+  std::vector<hash_value_set> m_sites;
+  std::vector<bool> m_saturated;
+  unsigned m_max_hashes;
+  bool m_collected;
+}; // class TrainingHashes
+
+} // namespace oh
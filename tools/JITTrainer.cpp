@@ -0,0 +1,366 @@
+#include "JITTrainer.h"
+
+#include "AssertionFinalizePass.h"
+#include "AssertionInsertionPass.h"
+#include "TrainingHashes.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Mangler.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <utility>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace oh {
+
+namespace {
+
+// exit handlers registered by the program being trained, run when its main
+// returns or it calls exit, instead of at exit of the trainer
+std::vector<std::pair<void (*)(void *), void *>> exit_handlers;
+// runs the exit handlers and static destructors of the trained module and
+// sends the collected hashes to the trainer, set in the child process
+std::function<void()> finish_run;
+char dso_handle;
+
+void call_exit_handler(void *handler) {
+  reinterpret_cast<void (*)()>(handler)();
+}
+
+int jit_atexit(void (*handler)()) {
+  exit_handlers.emplace_back(call_exit_handler,
+                             reinterpret_cast<void *>(handler));
+  return 0;
+}
+
+int jit_cxa_atexit(void (*handler)(void *), void *arg, void *) {
+  exit_handlers.emplace_back(handler, arg);
+  return 0;
+}
+
+void run_exit_handlers() {
+  while (!exit_handlers.empty()) {
+    auto handler = exit_handlers.back();
+    exit_handlers.pop_back();
+    handler.first(handler.second);
+  }
+}
+
+// ends the child process of a training run like exit would, without the
+// exit handlers of the trainer. exit called by an exit handler ends the run
+// at once.
+[[noreturn]] void end_run(int status) {
+  std::function<void()> finish;
+  finish.swap(finish_run);
+  if (finish) {
+    finish();
+  }
+  std::fflush(nullptr);
+  _exit(status);
+}
+
+[[noreturn]] void jit_exit(int status) { end_run(status); }
+
+bool write_all(int fd, const std::string &data) {
+  for (size_t written = 0; written < data.size();) {
+    const ssize_t size = write(fd, data.data() + written, data.size() - written);
+    if (size < 0 && errno != EINTR) {
+      return false;
+    }
+    written += std::max<ssize_t>(size, 0);
+  }
+  return true;
+}
+
+// the last line the child sends, after the hashes of both stages
+const char state_end[] = "done\n";
+
+std::string read_all(int fd) {
+  std::string data;
+  char buffer[4096];
+  for (;;) {
+    const ssize_t size = read(fd, buffer, sizeof(buffer));
+    if (size > 0) {
+      data.append(buffer, size);
+    } else if (size == 0 || errno != EINTR) {
+      return data;
+    }
+  }
+}
+
+void jit_oh_log(unsigned id, uint64_t *hashVar) {
+  TrainingHashes::get(TrainingHashes::Log).add(id, *hashVar);
+}
+
+void jit_oh_input_dep_log(unsigned, uint64_t *, uint64_t) {}
+
+void jit_oh_assert_dumper(unsigned id, uint64_t *hashVar, int, ...) {
+  if (hashVar == nullptr) {
+    return;
+  }
+  TrainingHashes::get(TrainingHashes::Dumper).add(id, *hashVar);
+}
+
+template <typename Function> uint64_t get_address(Function function) {
+  return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(function));
+}
+
+bool train(JITTrainer &trainer, llvm::Module &M,
+           const std::vector<std::string> &inputs, const char *stage) {
+  const unsigned passed = trainer.run(M, inputs);
+  llvm::errs() << stage << ": " << passed << " of " << inputs.size()
+               << " training runs passed\n";
+  return passed != 0;
+}
+
+void run_pass(llvm::Module &M, llvm::Pass *pass) {
+  llvm::legacy::PassManager PM;
+  PM.add(pass);
+  PM.run(M);
+}
+}
+
+JITTrainer::JITTrainer()
+    : target_machine(llvm::EngineBuilder().selectTarget()),
+      data_layout(target_machine->createDataLayout()),
+      compile_layer(object_layer, llvm::orc::SimpleCompiler(*target_machine)) {
+  llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  host_symbols[mangle("oh_log")] = get_address(jit_oh_log);
+  host_symbols[mangle("oh_assert_dumper")] = get_address(jit_oh_assert_dumper);
+  host_symbols[mangle("oh_input_dep_log")] = get_address(jit_oh_input_dep_log);
+  host_symbols[mangle("atexit")] = get_address(jit_atexit);
+  host_symbols[mangle("__cxa_atexit")] = get_address(jit_cxa_atexit);
+  host_symbols[mangle("__dso_handle")] = get_address(&dso_handle);
+  host_symbols[mangle("exit")] = get_address(jit_exit);
+}
+
+// the module is compiled once, every input runs in a child process forked
+// from the trainer, which inherits the compiled code and the initial data
+unsigned JITTrainer::run(const llvm::Module &M,
+                         const std::vector<std::string> &inputs) {
+  for (const auto &global : M.globals()) {
+    if (global.isThreadLocal()) {
+      llvm::errs() << "ERR. thread local variables (" << global.getName()
+                   << ") are not supported by the JIT trainer\n";
+      return 0;
+    }
+  }
+  auto copy = llvm::CloneModule(&M);
+  prepare_module(*copy);
+  const std::string program_name = copy->getModuleIdentifier();
+  std::vector<std::string> ctor_names;
+  for (auto ctor : llvm::orc::getConstructors(*copy)) {
+    ctor_names.push_back(mangle(ctor.Func->getName()));
+  }
+  std::vector<std::string> dtor_names;
+  for (auto dtor : llvm::orc::getDestructors(*copy)) {
+    dtor_names.push_back(mangle(dtor.Func->getName()));
+  }
+
+  auto resolver = llvm::orc::createLambdaResolver(
+      [this](const std::string &name) {
+        if (auto symbol = compile_layer.findSymbol(name, false)) {
+          return symbol.toRuntimeDyldSymbol();
+        }
+        return llvm::RuntimeDyld::SymbolInfo(nullptr);
+      },
+      [this](const std::string &name) {
+        auto host_symbol = host_symbols.find(name);
+        if (host_symbol != host_symbols.end()) {
+          return llvm::RuntimeDyld::SymbolInfo(host_symbol->second,
+                                               llvm::JITSymbolFlags::Exported);
+        }
+        if (auto address =
+                llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name)) {
+          return llvm::RuntimeDyld::SymbolInfo(address,
+                                               llvm::JITSymbolFlags::Exported);
+        }
+        return llvm::RuntimeDyld::SymbolInfo(nullptr);
+      });
+  std::vector<std::unique_ptr<llvm::Module>> modules;
+  modules.push_back(std::move(copy));
+  auto handle = compile_layer.addModuleSet(
+      std::move(modules), llvm::make_unique<llvm::SectionMemoryManager>(),
+      std::move(resolver));
+
+  // resolving main compiles and finalizes the module before the first fork
+  auto main_symbol = compile_layer.findSymbolIn(handle, mangle("main"), false);
+  if (!main_symbol) {
+    llvm::errs() << "ERR. the trained module has no main function\n";
+    compile_layer.removeModuleSet(handle);
+    return 0;
+  }
+  auto main_function = reinterpret_cast<MainFunction>(
+      static_cast<uintptr_t>(main_symbol.getAddress()));
+  CtorDtorRunner ctors(std::move(ctor_names), handle);
+  CtorDtorRunner dtors(std::move(dtor_names), handle);
+
+  unsigned passed = 0;
+  for (const auto &input : inputs) {
+    std::vector<std::string> args{program_name};
+    std::istringstream input_strm(input);
+    for (std::string arg; input_strm >> arg;) {
+      args.push_back(arg);
+    }
+    const int status = run_child(main_function, ctors, dtors, args);
+    if (status == 0) {
+      ++passed;
+    } else {
+      llvm::errs() << "Training run '" << input << "' exited with status "
+                   << status << "\n";
+    }
+  }
+  compile_layer.removeModuleSet(handle);
+  return passed;
+}
+
+std::string JITTrainer::mangle(const std::string &name) const {
+  std::string mangled_name;
+  llvm::raw_string_ostream mangled_strm(mangled_name);
+  llvm::Mangler::getNameWithPrefix(mangled_strm, name, data_layout);
+  return mangled_strm.str();
+}
+
+// modules already linked with the logging runtime keep using the trainer's
+// hooks
+void JITTrainer::prepare_module(llvm::Module &M) const {
+  M.setDataLayout(data_layout);
+  for (const char *name : {"oh_log", "oh_assert_dumper", "oh_input_dep_log"}) {
+    auto *F = M.getFunction(name);
+    if (F != nullptr && !F->isDeclaration()) {
+      F->deleteBody();
+    }
+  }
+}
+
+// a training run is a child process, so the program's exit, abort or crash
+// end the run only. The child sends the hashes of both stages back through
+// a pipe when the program exits; a killed child reports 128 + the signal
+// number, like a shell.
+int JITTrainer::run_child(MainFunction main_function, CtorDtorRunner &ctors,
+                          CtorDtorRunner &dtors,
+                          std::vector<std::string> &args) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    llvm::errs() << "ERR. cannot create a pipe: " << std::strerror(errno)
+                 << "\n";
+    return -1;
+  }
+  llvm::outs().flush();
+  std::fflush(nullptr);
+  const pid_t pid = fork();
+  if (pid < 0) {
+    llvm::errs() << "ERR. cannot fork: " << std::strerror(errno) << "\n";
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    run_main(main_function, ctors, dtors, args, fds[1]);
+  }
+  close(fds[1]);
+  const std::string state = read_all(fds[0]);
+  close(fds[0]);
+  int wait_status = 0;
+  while (waitpid(pid, &wait_status, 0) < 0 && errno == EINTR) {
+  }
+  const size_t end_size = sizeof(state_end) - 1;
+  const bool reported = state.size() >= end_size &&
+                        state.compare(state.size() - end_size, end_size,
+                                      state_end) == 0;
+  if (reported) {
+    std::istringstream state_strm(state);
+    TrainingHashes::get(TrainingHashes::Log).read_state(state_strm);
+    TrainingHashes::get(TrainingHashes::Dumper).read_state(state_strm);
+  }
+  if (WIFSIGNALED(wait_status)) {
+    return 128 + WTERMSIG(wait_status);
+  }
+  const int status = WEXITSTATUS(wait_status);
+  if (status == 0 && !reported) {
+    llvm::errs() << "Training run ended without reporting its hashes\n";
+    return -1;
+  }
+  return status;
+}
+
+void JITTrainer::run_main(MainFunction main_function, CtorDtorRunner &ctors,
+                          CtorDtorRunner &dtors,
+                          std::vector<std::string> &args, int output) {
+  std::vector<char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+
+  exit_handlers.clear();
+  finish_run = [this, &dtors, output]() {
+    run_exit_handlers();
+    dtors.runViaLayer(compile_layer);
+    std::ostringstream state_strm;
+    TrainingHashes::get(TrainingHashes::Log).write_state(state_strm);
+    TrainingHashes::get(TrainingHashes::Dumper).write_state(state_strm);
+    state_strm << state_end;
+    if (!write_all(output, state_strm.str())) {
+      llvm::errs() << "ERR. cannot send the training hashes\n";
+    }
+  };
+  ctors.runViaLayer(compile_layer);
+  end_run(main_function(args.size(), argv.data()));
+}
+
+std::vector<std::string> read_training_inputs(const std::string &file_name) {
+  std::vector<std::string> inputs;
+  if (file_name.empty()) {
+    inputs.emplace_back();
+    return inputs;
+  }
+  std::ifstream inputs_strm(file_name);
+  for (std::string line; std::getline(inputs_strm, line);) {
+    inputs.push_back(line);
+  }
+  return inputs;
+}
+
+bool train_assertions(llvm::Module &M, const std::vector<std::string> &inputs,
+                      unsigned max_hashes) {
+  JITTrainer trainer;
+  auto &log_hashes = TrainingHashes::get(TrainingHashes::Log);
+  log_hashes.start_collecting(max_hashes);
+  if (!train(trainer, M, inputs, "logging")) {
+    return false;
+  }
+  llvm::errs() << log_hashes.get_saturated_count()
+               << " sites saturated and get no assertion\n";
+  run_pass(M, new AssertionInsertionPass());
+
+  TrainingHashes::get(TrainingHashes::Dumper).start_collecting(0);
+  if (!train(trainer, M, inputs, "dumping")) {
+    return false;
+  }
+  run_pass(M, new AssertionFinalizePass());
+  return true;
+}
+
+} // namespace oh
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace llvm {
+class Module;
+}
+
+namespace oh {
+
+// Runs instrumented modules in process with ORC instead of compiling and
+// running a training binary. The trainer provides oh_log and
+// oh_assert_dumper itself and records the hashes into TrainingHashes, where
+// the assertion passes pick them up.
+// The native target has to be initialized before creating a trainer.
+class JITTrainer {
+public:
+  JITTrainer();
+
+  JITTrainer(const JITTrainer &) = delete;
+  JITTrainer &operator=(const JITTrainer &) = delete;
+
+public:
+  // compiles a copy of M and runs its main once per input, each run in a
+  // child process, the arguments of a run are the whitespace separated words
+  // of its input.
+  // Returns the number of runs that exited with status 0.
+  unsigned run(const llvm::Module &M, const std::vector<std::string> &inputs);
+
+private:
+  using ObjectLayer = llvm::orc::ObjectLinkingLayer<>;
+  using CompileLayer = llvm::orc::IRCompileLayer<ObjectLayer>;
+  using CtorDtorRunner = llvm::orc::CtorDtorRunner<CompileLayer>;
+  using MainFunction = int (*)(int, char **);
+
+private:
+  std::string mangle(const std::string &name) const;
+  void prepare_module(llvm::Module &M) const;
+  int run_child(MainFunction main_function, CtorDtorRunner &ctors,
+                CtorDtorRunner &dtors, std::vector<std::string> &args);
+  // runs in the child process, output is the pipe to the trainer
+  [[noreturn]] void run_main(MainFunction main_function, CtorDtorRunner &ctors,
+                             CtorDtorRunner &dtors,
+                             std::vector<std::string> &args, int output);
+
+private:
+  std::unique_ptr<llvm::TargetMachine> target_machine;
+  const llvm::DataLayout data_layout;
+  ObjectLayer object_layer;
+  CompileLayer compile_layer;
+  // runtime functions replaced by the trainer, by mangled name
+  std::unordered_map<std::string, uint64_t> host_symbols;
+}; // class JITTrainer
+
+// lines of a training inputs file, a single run without arguments when no
+// file is given
+std::vector<std::string> read_training_inputs(const std::string &file_name);
+
+// trains the loggers of M, runs -insert-asserts on it, trains the dumped
+// hashes and runs -insert-asserts-finalize. Returns false when no training
+// run of a stage passed.
+bool train_assertions(llvm::Module &M, const std::vector<std::string> &inputs,
+                      unsigned max_hashes);
+
+} // namespace oh
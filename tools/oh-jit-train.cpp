@@ -0,0 +1,79 @@
+// Trains the assertions of a module instrumented with -oh-insert in process.
+//
+// The module (linked with hash.bc) is JIT compiled and run once per line of
+// the -inputs file, the logged hashes are handed to -insert-asserts in
+// memory. The result is run the same way to collect the dumped hashes for
+// -insert-asserts-finalize, whose options (-oh-assert-mode, ...) are
+// accepted as well. The output is the protected bitcode.
+
+#include "JITTrainer.h"
+
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string>
+#include <vector>
+
+static llvm::cl::opt<std::string>
+    input_file(llvm::cl::Positional, llvm::cl::desc("<instrumented bitcode>"),
+               llvm::cl::Required);
+
+static llvm::cl::opt<std::string> training_inputs(
+    "inputs",
+    llvm::cl::desc("File with the arguments of one training run per line, "
+                   "without it main is run once without arguments"),
+    llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<unsigned> max_hashes(
+    "max-hashes",
+    llvm::cl::desc("Sites logging more distinct hashes get no assertion, "
+                   "like OH_LOG_MAX_HASHES of the logging runtime"),
+    llvm::cl::init(16));
+
+static llvm::cl::opt<std::string> output("o", llvm::cl::desc("Output bitcode"),
+                                         llvm::cl::value_desc("filename"),
+                                         llvm::cl::Required);
+
+int main(int argc, char **argv) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+  llvm::cl::ParseCommandLineOptions(argc, argv,
+                                    "in process training of oh assertions\n");
+
+  llvm::LLVMContext Ctx;
+  llvm::SMDiagnostic error;
+  std::unique_ptr<llvm::Module> M = llvm::parseIRFile(input_file, error, Ctx);
+  if (!M) {
+    error.print(argv[0], llvm::errs());
+    return 1;
+  }
+  const auto inputs = oh::read_training_inputs(training_inputs);
+  if (inputs.empty()) {
+    llvm::errs() << "ERR. no training inputs in " << training_inputs << "\n";
+    return 1;
+  }
+  if (!oh::train_assertions(*M, inputs, max_hashes)) {
+    return 1;
+  }
+
+  if (llvm::verifyModule(*M, &llvm::errs())) {
+    return 1;
+  }
+  std::error_code EC;
+  llvm::raw_fd_ostream out(output, EC, llvm::sys::fs::F_None);
+  if (EC) {
+    llvm::errs() << "cannot open " << output << ": " << EC.message() << "\n";
+    return 1;
+  }
+  llvm::WriteBitcodeToFile(M.get(), out);
+  return 0;
+}
@@ -0,0 +1,297 @@
+// Protects a program with oblivious hashing in a single process.
+//
+// The program bitcode is loaded and linked once and stays in memory for all
+// stages: -oh-insert, linking the hash runtime, in process training of the
+// loggers and dumped hashes (see oh-jit-train), -insert-asserts,
+// -insert-asserts-finalize, linking the assertion runtime and code
+// generation. The options of the passes are accepted as well. With
+// -opt-level the standard optimization pipeline runs before -oh-insert
+// (-oh-insertion-point=late) or after it.
+
+#include "JITTrainer.h"
+#include "ObliviousHashInsertion.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum EmitKind { EmitBitcode, EmitObject, EmitExecutable };
+
+static llvm::cl::list<std::string>
+    input_files(llvm::cl::Positional, llvm::cl::desc("<program bitcode>..."),
+                llvm::cl::OneOrMore);
+
+static llvm::cl::opt<std::string>
+    hash_runtime("hash-runtime", llvm::cl::desc("Bitcode of hashes/hash.c"),
+                 llvm::cl::value_desc("filename"), llvm::cl::Required);
+
+static llvm::cl::list<std::string> runtimes(
+    "runtime",
+    llvm::cl::desc("Bitcode linked into the protected program, e.g. "
+                   "assertions/asserts.cpp"),
+    llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<std::string> training_inputs(
+    "inputs",
+    llvm::cl::desc("File with the arguments of one training run per line, "
+                   "without it main is run once without arguments"),
+    llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<unsigned> max_hashes(
+    "max-hashes",
+    llvm::cl::desc("Sites logging more distinct hashes get no assertion, "
+                   "like OH_LOG_MAX_HASHES of the logging runtime"),
+    llvm::cl::init(16));
+
+static llvm::cl::opt<EmitKind> emit(
+    "emit", llvm::cl::desc("Output kind"),
+    llvm::cl::values(clEnumValN(EmitBitcode, "bc", "protected bitcode"),
+                     clEnumValN(EmitObject, "obj", "object file"),
+                     clEnumValN(EmitExecutable, "exe",
+                                "executable, linked with -linker"),
+                     clEnumValEnd),
+    llvm::cl::init(EmitExecutable));
+
+static llvm::cl::opt<unsigned> opt_level(
+    "opt-level",
+    llvm::cl::desc("Level of the standard optimization pipeline (0-3), run "
+                   "before -oh-insert with -oh-insertion-point=late and after "
+                   "it otherwise"),
+    llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned>
+    codegen_opt("codegen-opt", llvm::cl::desc("Code generation level (0-3)"),
+                llvm::cl::init(2));
+
+static llvm::cl::opt<std::string>
+    linker("linker", llvm::cl::desc("Compiler driver linking the executable"),
+           llvm::cl::init("clang++-3.9"));
+
+static llvm::cl::list<std::string>
+    link_args("link-arg", llvm::cl::desc("Argument passed to the linker"),
+              llvm::cl::value_desc("arg"));
+
+static llvm::cl::opt<std::string> output("o", llvm::cl::desc("Output file"),
+                                         llvm::cl::value_desc("filename"),
+                                         llvm::cl::Required);
+
+namespace {
+
+std::unique_ptr<llvm::Module> load(const std::string &file_name,
+                                   llvm::LLVMContext &Ctx) {
+  llvm::SMDiagnostic error;
+  auto M = llvm::parseIRFile(file_name, error, Ctx);
+  if (!M) {
+    error.print("oh-protect", llvm::errs());
+  }
+  return M;
+}
+
+bool link(llvm::Module &M, const std::string &file_name) {
+  auto src = load(file_name, M.getContext());
+  if (!src) {
+    return false;
+  }
+  if (llvm::Linker::linkModules(M, std::move(src))) {
+    llvm::errs() << "ERR. cannot link " << file_name << "\n";
+    return false;
+  }
+  return true;
+}
+
+// only the module pipeline is run: the function pipeline would add
+// -oh-insert at EP_EarlyAsPossible. With -oh-insertion-point=late the
+// module pipeline runs -oh-insert at its end, at every level.
+void optimize(llvm::Module &M) {
+  llvm::PassManagerBuilder builder;
+  builder.OptLevel = std::min(3u, unsigned(opt_level));
+  if (builder.OptLevel > 0) {
+    builder.Inliner = llvm::createFunctionInliningPass(builder.OptLevel, 0);
+  }
+  builder.LoopVectorize = builder.OptLevel > 1;
+  builder.SLPVectorize = builder.OptLevel > 1;
+  llvm::legacy::PassManager PM;
+  builder.populateModulePassManager(PM);
+  PM.run(M);
+}
+
+bool write_bitcode(llvm::Module &M, const std::string &file_name) {
+  std::error_code EC;
+  llvm::raw_fd_ostream out(file_name, EC, llvm::sys::fs::F_None);
+  if (EC) {
+    llvm::errs() << "cannot open " << file_name << ": " << EC.message() << "\n";
+    return false;
+  }
+  llvm::WriteBitcodeToFile(&M, out);
+  return true;
+}
+
+bool write_object(llvm::Module &M, const std::string &file_name) {
+  if (M.getTargetTriple().empty()) {
+    M.setTargetTriple(llvm::sys::getDefaultTargetTriple());
+  }
+  std::string error;
+  const llvm::Target *target =
+      llvm::TargetRegistry::lookupTarget(M.getTargetTriple(), error);
+  if (target == nullptr) {
+    llvm::errs() << "ERR. " << error << "\n";
+    return false;
+  }
+  const llvm::CodeGenOpt::Level levels[] = {
+      llvm::CodeGenOpt::None, llvm::CodeGenOpt::Less,
+      llvm::CodeGenOpt::Default, llvm::CodeGenOpt::Aggressive};
+  std::unique_ptr<llvm::TargetMachine> target_machine(
+      target->createTargetMachine(
+          M.getTargetTriple(), llvm::sys::getHostCPUName(), "",
+          llvm::TargetOptions(), llvm::Reloc::PIC_, llvm::CodeModel::Default,
+          levels[std::min(3u, unsigned(codegen_opt))]));
+  M.setDataLayout(target_machine->createDataLayout());
+
+  std::error_code EC;
+  llvm::raw_fd_ostream out(file_name, EC, llvm::sys::fs::F_None);
+  if (EC) {
+    llvm::errs() << "cannot open " << file_name << ": " << EC.message() << "\n";
+    return false;
+  }
+  llvm::legacy::PassManager PM;
+  if (target_machine->addPassesToEmitFile(
+          PM, out, llvm::TargetMachine::CGFT_ObjectFile)) {
+    llvm::errs() << "ERR. the target can not emit object files\n";
+    return false;
+  }
+  PM.run(M);
+  return true;
+}
+
+bool write_executable(llvm::Module &M, const std::string &file_name) {
+  llvm::SmallString<128> object_path;
+  if (llvm::sys::fs::createTemporaryFile("oh-protect", "o", object_path)) {
+    llvm::errs() << "ERR. cannot create a temporary object file\n";
+    return false;
+  }
+  const std::string object_file(object_path.begin(), object_path.end());
+  if (!write_object(M, object_file)) {
+    llvm::sys::fs::remove(object_file);
+    return false;
+  }
+  auto linker_path = llvm::sys::findProgramByName(linker);
+  if (!linker_path) {
+    llvm::errs() << "ERR. cannot find " << linker << "\n";
+    llvm::sys::fs::remove(object_file);
+    return false;
+  }
+  // the runtime uses threads (-oh-assert-mode=async) and shared memory
+  // (OH_TELEMETRY)
+  std::vector<std::string> args{*linker_path, object_file, "-o",
+                                file_name, "-rdynamic", "-pthread", "-lrt"};
+  args.insert(args.end(), link_args.begin(), link_args.end());
+  std::vector<const char *> argv;
+  for (const auto &arg : args) {
+    argv.push_back(arg.c_str());
+  }
+  argv.push_back(nullptr);
+  std::string error;
+  const int status = llvm::sys::ExecuteAndWait(*linker_path, argv.data(),
+                                               nullptr, nullptr, 0, 0, &error);
+  llvm::sys::fs::remove(object_file);
+  if (status != 0) {
+    llvm::errs() << "ERR. linking failed " << error << "\n";
+    return false;
+  }
+  return true;
+}
+}
+
+int main(int argc, char **argv) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+  llvm::PassRegistry &registry = *llvm::PassRegistry::getPassRegistry();
+  llvm::initializeCore(registry);
+  llvm::initializeAnalysis(registry);
+  llvm::initializeTransformUtils(registry);
+  llvm::cl::ParseCommandLineOptions(argc, argv,
+                                    "oblivious hashing protection driver\n");
+  // the JIT trainer can not run thread local variables, fail before the
+  // program is instrumented
+  if (oh::ObliviousHashInsertionPass::uses_thread_local_hashes()) {
+    llvm::errs() << "ERR. -oh-thread-local-hashes is not supported by in "
+                    "process training, train with the logging runtime\n";
+    return 1;
+  }
+
+  llvm::LLVMContext Ctx;
+  std::unique_ptr<llvm::Module> M = load(input_files.front(), Ctx);
+  if (!M) {
+    return 1;
+  }
+  for (unsigned i = 1; i < input_files.size(); ++i) {
+    if (!link(*M, input_files[i])) {
+      return 1;
+    }
+  }
+  const auto inputs = oh::read_training_inputs(training_inputs);
+  if (inputs.empty()) {
+    llvm::errs() << "ERR. no training inputs in " << training_inputs << "\n";
+    return 1;
+  }
+
+  if (oh::ObliviousHashInsertionPass::inserts_late()) {
+    optimize(*M);
+  } else {
+    {
+      llvm::legacy::PassManager PM;
+      PM.add(new oh::ObliviousHashInsertionPass());
+      PM.run(*M);
+    }
+    if (opt_level > 0) {
+      optimize(*M);
+    }
+  }
+  if (!link(*M, hash_runtime) ||
+      !oh::train_assertions(*M, inputs, max_hashes)) {
+    return 1;
+  }
+  for (const auto &runtime : runtimes) {
+    if (!link(*M, runtime)) {
+      return 1;
+    }
+  }
+  if (llvm::verifyModule(*M, &llvm::errs())) {
+    return 1;
+  }
+
+  switch (emit) {
+  case EmitBitcode:
+    return write_bitcode(*M, output) ? 0 : 1;
+  case EmitObject:
+    return write_object(*M, output) ? 0 : 1;
+  case EmitExecutable:
+    return write_executable(*M, output) ? 0 : 1;
+  }
+  return 1;
+}
@@ -0,0 +1,145 @@
+// Samples the check counters of a running protected program.
+//
+// usage: oh-telemetry [--unlink] <segment> [interval ms] [samples]
+//
+// <segment> is the shared memory segment the assertion runtime creates when
+// the program runs with OH_TELEMETRY=<name>, i.e. /<name>.<pid>. Every sample
+// prints the checks, passes and failures of each site group that ran, summed
+// over the program's threads. Without an interval the counters are printed
+// once. Sampling stops with a final sample when the program exits; the
+// program unlinks the segment at exit, the mapping stays readable. Segments
+// kept with OH_TELEMETRY_KEEP are removed with --unlink after the last sample.
+
+#include "telemetry.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace {
+
+uint64_t read_counter(const uint64_t *counter) {
+  // the program increments without synchronization, aligned 64 bit loads
+  // see either the old or the new value
+  return *static_cast<const volatile uint64_t *>(counter);
+}
+
+bool has_exited(const oh_telemetry::header *segment) {
+  return kill(static_cast<pid_t>(segment->pid), 0) != 0 && errno == ESRCH;
+}
+
+void print_sample(oh_telemetry::header *segment) {
+  const uint32_t groups = segment->groups_count;
+  const uint32_t rows = std::min(
+      __atomic_load_n(&segment->rows_used, __ATOMIC_RELAXED), segment->rows_count);
+  std::vector<uint64_t> checks(groups, 0);
+  std::vector<uint64_t> failures(groups, 0);
+  for (uint32_t r = 0; r < rows; ++r) {
+    const uint64_t *row = oh_telemetry::row(segment, r);
+    for (uint32_t g = 0; g < groups; ++g) {
+      checks[g] += read_counter(row + g);
+      failures[g] += read_counter(row + groups + g);
+    }
+  }
+  uint64_t total_checks = 0;
+  uint64_t total_failures = 0;
+  printf("pid %llu, %u threads\n", (unsigned long long)segment->pid, rows);
+  printf("%8s %21s %14s %14s %10s\n", "group", "sites", "checks", "passed",
+         "failed");
+  for (uint32_t g = 0; g < groups; ++g) {
+    if (checks[g] == 0 && failures[g] == 0) {
+      continue;
+    }
+    const unsigned long long first = (unsigned long long)g << segment->group_bits;
+    char sites[32];
+    if (g + 1 == groups) {
+      snprintf(sites, sizeof(sites), "%llu-", first);
+    } else {
+      snprintf(sites, sizeof(sites), "%llu-%llu", first,
+               first + (1ull << segment->group_bits) - 1);
+    }
+    // failed checks may be counted before their check is visible
+    const uint64_t passed = checks[g] > failures[g] ? checks[g] - failures[g] : 0;
+    printf("%8u %21s %14llu %14llu %10llu\n", g, sites,
+           (unsigned long long)checks[g], (unsigned long long)passed,
+           (unsigned long long)failures[g]);
+    total_checks += checks[g];
+    total_failures += failures[g];
+  }
+  printf("%8s %21s %14llu %14llu %10llu\n\n", "total", "",
+         (unsigned long long)total_checks,
+         (unsigned long long)(total_checks - std::min(total_checks, total_failures)),
+         (unsigned long long)total_failures);
+  fflush(stdout);
+}
+}
+
+int main(int argc, char *argv[]) {
+  const bool unlink_segment = argc > 1 && strcmp(argv[1], "--unlink") == 0;
+  if (unlink_segment) {
+    --argc;
+    ++argv;
+  }
+  if (argc < 2) {
+    fprintf(stderr, "usage: oh-telemetry [--unlink] <segment> [interval ms] "
+                    "[samples]\n");
+    return 1;
+  }
+  const char *segment_name = argv[1];
+  const unsigned interval = argc > 2 ? strtoul(argv[2], nullptr, 10) : 0;
+  const unsigned samples = argc > 3 ? strtoul(argv[3], nullptr, 10) : 0;
+
+  int fd = shm_open(segment_name, O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf(stderr, "cannot open telemetry segment %s\n", segment_name);
+    return 1;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      info.st_size < (off_t)sizeof(oh_telemetry::header)) {
+    fprintf(stderr, "%s is not a telemetry segment\n", segment_name);
+    close(fd);
+    return 1;
+  }
+  void *memory = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    fprintf(stderr, "cannot map telemetry segment %s\n", segment_name);
+    return 1;
+  }
+  auto *segment = static_cast<oh_telemetry::header *>(memory);
+  if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != oh_telemetry::magic ||
+      segment->version != oh_telemetry::version ||
+      (uint64_t)info.st_size < oh_telemetry::segment_size(segment->rows_count,
+                                                          segment->groups_count)) {
+    fprintf(stderr, "%s is not a telemetry segment\n", segment_name);
+    return 1;
+  }
+
+  for (unsigned sample = 0;; ++sample) {
+    // the counters are final once the program exited
+    const bool exited = has_exited(segment);
+    print_sample(segment);
+    if (interval == 0 || exited || (samples != 0 && sample + 1 >= samples)) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+  }
+  munmap(memory, info.st_size);
+  if (unlink_segment && shm_unlink(segment_name) != 0) {
+    fprintf(stderr, "cannot unlink telemetry segment %s\n", segment_name);
+    return 1;
+  }
+  return 0;
+}